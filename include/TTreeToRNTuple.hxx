@@ -17,13 +17,19 @@
 #include <TClass.h>
 #include <TSystem.h>
 #include <TInterpreter.h>
+#include <TKey.h>
+#include <TTreeFormula.h>
 
+#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <regex>
 #include <set>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <utility>
 
@@ -36,6 +42,8 @@ using RNTupleWriter = ROOT::Experimental::RNTupleWriter;
 using RCompressionSetting = ROOT::RCompressionSetting;
 
 typedef void (*callback_t)(int, int);
+// Receives the addresses of the values of the filter branches, in the order they were given to SetFilter()
+typedef bool (*filter_t)(const std::vector<void *> &);
 
 struct FlatField
 {
@@ -45,8 +53,29 @@ struct FlatField
     Int_t leafTypeSize; // sizeof(leafType)
     Bool_t isVariableSizedArray;
     Int_t arrayLength; // 1 if non-array; size of the array if fixed-length array; maximun size if variable-sized array.
+    TTree *tree;       // the tree owning the branch, i.e. the converted tree or one of its friends
+    TLeaf *leaf;
     std::unique_ptr<unsigned char[]> treeBuffer;
-    std::unique_ptr<unsigned char[]> ntupleBuffer;
+    std::vector<unsigned char> ntupleBuffer; // variable-sized arrays only; captured as std::vector<T>, capacity reserved once
+    unsigned char *address;                  // where the branch values are: treeBuffer, or the producer's variables when streaming
+};
+
+enum EStringKind
+{
+    kNoString,
+    kString,       // std::string
+    kStringVector, // std::vector<std::string>
+    kStringRVec    // ROOT::RVec<std::string>
+};
+
+// Strings of a low-cardinality field are written as indices into a dictionary, see SetStringDictionaryEncoding()
+struct StringDictionary
+{
+    EStringKind kind;
+    std::unordered_map<std::string, std::uint32_t> index;
+    std::vector<std::string> values;
+    std::uint32_t encoded;                     // captured by the REntry for kString
+    std::vector<std::uint32_t> encodedStrings; // captured by the REntry for string collections
 };
 
 struct ContainerField
@@ -54,8 +83,54 @@ struct ContainerField
     std::string treeName;
     std::string ntupleName;
     std::string typeName;
-    std::shared_ptr<void *> treeBuffer;
-    std::unique_ptr<unsigned char[]> ntupleBuffer;
+    TTree *tree; // the tree owning the branch, i.e. the converted tree or one of its friends
+    TBranch *branch;
+    TClass *kClass;
+    std::shared_ptr<void> treeObject;   // owned by the converter and reused for every entry, see AcquireObject()
+    std::shared_ptr<void *> treeBuffer; // points to treeObject; handed to TTree::SetBranchAddress()
+    std::unique_ptr<StringDictionary> stringDictionary; // null unless the field is dictionary-encoded
+    void *address;                                      // treeObject, or the producer's object when streaming
+};
+
+struct FriendTree
+{
+    std::string mainTreeName; // the converted tree the friend is joined to
+    std::string treeName;
+    std::string fileName; // empty if the friend tree is in the input file
+    std::string alias;    // prefix of the converted fields, e.g. 'alias__branch'
+};
+
+// Branch names given by exact name, glob wildcard ('Jet_*') or regex ('/^Jet_(pt|eta)$/'). Names and globs are
+// compared after SanitizeBranchName(); regexes match either the branch name ('Calib.nZ') or the field name ('Calib__nZ').
+struct BranchMatcher
+{
+    std::unordered_set<std::string> names;
+    std::vector<std::string> globs;
+    std::vector<std::regex> regexes;
+};
+
+// Value of a sort key; integer keys are kept as integers, so that they compare exactly beyond 2^53
+enum ESortKeyKind
+{
+    kSignedKey,
+    kUnsignedKey,
+    kRealKey
+};
+
+union SortKey
+{
+    Long64_t integer;
+    ULong64_t unsignedInteger;
+    Double_t real;
+};
+
+// A self-contained RNTuple in one of the output files, covering entries [firstEntry, firstEntry + nEntries)
+struct OutputPiece
+{
+    std::string ntupleName;
+    std::string fileName;
+    Long64_t firstEntry;
+    Long64_t nEntries;
 };
 
 class TTreeToRNTuple
@@ -65,35 +140,131 @@ public:
     TTreeToRNTuple(std::string input, std::string output, std::string treeName, std::string compressionAlgo, int compressionLevel);
     TTreeToRNTuple(std::string input, std::string output, std::string treeName, std::string compressionAlgo, int compressionLevel, std::vector<std::string> dictionary);
 
-    ~TTreeToRNTuple(){};
+    ~TTreeToRNTuple();
 
     void SetInputFile(std::string input);
     void SetOutputFile(std::string output);
     void SetTreeName(std::string treeName);
+    void SetTreeNames(std::vector<std::string> treeNames);
+    void SelectAllTrees();
     void SetCompressionAlgo(std::string compressionAlgo);
     void SetCompressionAlgoLevel(std::string compressionAlgo, int compressionLevel);
     void SetDictionary(std::vector<std::string> dictionary);
     void SelectBranches(std::vector<std::string> subBranch);
+    void ExcludeBranches(std::vector<std::string> excludedBranch);
     void SelectAllBranches();
     void SetUserProgressCallbackFunc(callback_t);
+    void AddFriendTree(std::string mainTreeName, std::string treeName, std::string fileName = "", std::string alias = "");
+    void ClearFriendTrees();
+    void SetFilter(std::string expression);
+    void SetFilter(std::vector<std::string> branches, filter_t predicate);
+    void ClearFilter();
+    void SetMaxEntriesPerFile(Long64_t maxEntries);
+    void SetMaxBytesPerFile(Long64_t maxBytes);
+    void SetReorder(std::vector<std::string> keyBranches, Long64_t windowEntries = 0); // window 0: clusters of the input tree
+    void SetReorderMemory(Long64_t maxBytes);
+    void SetOriginalIndexField(std::string fieldName);
+    void SetStringDictionaryEncoding(Bool_t enable, Long64_t sampleEntries = 10000, UInt_t maxCardinality = 1024);
+    void SetCommitInterval(Double_t seconds); // streaming only: start a new output piece at least this often
+    void SetVerbosity(int verbosity); // 0: quiet; 1: summary (default); 2: every branch and field
+    void SetNumThreads(int nThreads);
+    void SetCacheSize(Long64_t cacheSize);
 
     std::string GetInputFile() { return fInputFile; };
     std::string GetOutputFile() { return fOutputFile; };
-    std::string GetTreeName() { return fTreeName; };
+    std::string GetTreeName() { return fTreeNames.empty() ? "" : fTreeNames.front(); };
+    std::vector<std::string> GetTreeNames() { return fTreeNames; };
     std::vector<std::string> GetDictionary() { return fDictionary; };
+    std::vector<OutputPiece> GetOutputPieces() { return fOutputPieces; };
+    std::string GetManifestFile();
 
     void Convert();
 
+    // Writes the source of a converter executable specialized to the current schema of the selected trees
+    void GenerateConverterSource(std::string sourceFile);
+
+    // Streaming from a tree that is being filled: call Fill() after every TTree::Fill() of the producer
+    void Attach(TTree *tree);
+    void Fill();
+    void Commit(); // closes the current piece now, e.g. when the producer pauses
+    void Detach();
+
+    static std::map<std::string, ULong64_t> GetFieldSizes(std::string fileName, std::string ntupleName);
+    static std::string GetStringDictionaryKey(std::string ntupleName, std::string fieldName);
+    static std::vector<std::string> ReadStringDictionary(std::string fileName, std::string ntupleName, std::string fieldName);
+
 private:
     RNTupleWriteOptions fWriteOptions;
     std::string fInputFile;
     std::string fOutputFile;
-    std::string fTreeName;
+    std::vector<std::string> fTreeNames; // empty means all trees in the input file
     std::vector<std::string> fDictionary;
-    std::vector<std::string> fSelectedBranches;
+    BranchMatcher fSelectedBranches; // empty means all branches
+    BranchMatcher fExcludedBranches;
+    std::vector<FriendTree> fFriendTrees;
     std::vector<FlatField> fFlatFields;
     std::vector<ContainerField> fContainerFields;
     std::string SanitizeBranchName(std::string name);
+    void AddBranchPattern(BranchMatcher &matcher, std::string pattern);
+    Bool_t MatchBranch(const BranchMatcher &matcher, const std::string &branchName, const std::string &ntupleName);
+    Bool_t IsBranchSelected(const std::string &branchName, const std::string &ntupleName);
+    Bool_t IsSelectingAllBranches();
+    std::vector<std::string> FindTreeNames(TFile &file);
+    void ConvertTree(TFile &inputFile, const std::string &treeName);
+    void DescribeTrees(const std::vector<std::pair<TTree *, std::string>> &trees);
+    std::string GetFieldType(const FlatField &f1);
+    std::unique_ptr<RNTupleModel> BuildModel(Long64_t nEntries, Bool_t bindBranches);
+    void OpenPiece(const RNTupleModel &model, const std::string &ntupleName, Long64_t firstEntry,
+                   std::unique_ptr<RNTupleWriter> &writer, std::unique_ptr<REntry> &entry);
+    void ClosePiece(const std::string &ntupleName, std::unique_ptr<RNTupleWriter> &writer, std::unique_ptr<REntry> &entry);
+    void PrepareEntry();
+    std::unique_ptr<REntry> BindEntry(RNTupleModel &model);
+    void SetBranchProcessing(TBranch *branch, Bool_t process);
+    void CacheBranches(const std::vector<std::pair<TTree *, std::string>> &trees, const std::vector<TBranch *> &extraBranches);
+    std::string GetOutputFileName(int index);
+    void OpenOutputFile();
+    Bool_t IsRollingOutput();
+    std::string GetIdentifier(const std::string &name);
+    void WriteTreeConverter(std::ostream &source, TTree *tree, std::set<std::string> &headers);
+    Bool_t RollOverPending();
+    void WriteManifest();
+    static std::string EscapeJson(const std::string &value);
+    void SortWindow(const std::vector<TLeaf *> &keyLeaves, Long64_t windowStart, Long64_t windowEnd,
+                    std::vector<Long64_t> &window, std::vector<SortKey> &keys);
+    EStringKind GetStringKind(const std::string &typeName);
+    Bool_t IsLowCardinality(ContainerField &c1, EStringKind kind, Long64_t nEntries);
+    void EncodeStrings(ContainerField &c1);
+    void WriteStringDictionaries(const std::string &ntupleName);
+    std::shared_ptr<void> AcquireObject(TClass *kClass);
+    void ReleaseObjects();
     callback_t fCallbackFunc;
+    int fVerbosity;
+    std::string fFilterExpression;
+    std::vector<std::string> fFilterBranches;
+    filter_t fFilterFunc;
+    int fNumThreads;
+    Long64_t fCacheSize;
+    Long64_t fMaxEntriesPerFile; // 0 means no limit
+    Long64_t fMaxBytesPerFile;   // 0 means no limit
+    int fNumOutputFiles;
+    std::unique_ptr<TFile> fOutput;
+    std::vector<OutputPiece> fOutputPieces;
+    std::vector<std::string> fSortKeys;
+    Long64_t fReorderWindow; // entries; 0 means the clusters of the input tree
+    Long64_t fReorderMemory; // bytes of decompressed baskets kept in memory while reading a window
+    std::string fOriginalIndexField; // empty means no original index column
+    ULong64_t fOriginalIndex;
+    Bool_t fStringDictEncoding;
+    Long64_t fStringDictSampleEntries;
+    UInt_t fStringDictMaxCardinality;
+    std::map<TClass *, std::vector<std::shared_ptr<void>>> fObjectPool; // container objects not bound to any branch
+    Double_t fCommitInterval; // seconds; 0 means no time-based roll-over
+    TTree *fStreamTree;       // the attached tree; null if not streaming
+    std::string fStreamTreeName; // kept, as the producer may delete the tree before Detach()
+    std::unique_ptr<RNTupleModel> fStreamModel;
+    std::unique_ptr<RNTupleWriter> fStreamWriter;
+    std::unique_ptr<REntry> fStreamEntry;
+    Long64_t fStreamEntries;
+    std::chrono::steady_clock::time_point fPieceStartTime; // when the current output piece was opened
 };
 #endif // TTREETORNTUPLE_H
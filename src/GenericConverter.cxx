@@ -1,16 +1,21 @@
 #include "TTreeToRNTuple.hxx"
 
+#include <map>
 #include <string>
 #include <vector>
 #include <iostream>
+#include <chrono>
 
 using RException = ROOT::Experimental::RException;
 
 static void Usage(char *progname)
 {
-    std::cout << "Usage: " << progname << " -i <input.root> -o <output.ntuple> -t(ree) <tree name> "
-              << "[-d(ictionary) <dictionary name>] [-s(ub branch) <branch name>]"
-              << "[-c(ompression) <compression algorithm>] [-p(rint conversion progress)]"
+    std::cout << "Usage: " << progname << " -i <input.root> -o <output.ntuple> -t(ree) <tree name> [-t(ree) <tree name> ...] | -a(ll trees) "
+              << "[-f(riend tree) [<main tree name>:]<tree name>[@<file name>]] [-e <filter expression>] "
+              << "[-d(ictionary) <dictionary name>] [-s(ub branch) <branch name or pattern>] [-x <excluded branch name or pattern>] "
+              << "[-k <sort key branch> [-w <reorder window entries>] [-I <original index field>] [-R(eport size gain)]] [-E(ncode low-cardinality strings)] [-v(erbose)] "
+              << "[-c(ompression) <compression algorithm>] [-n <max entries per output file>] [-m <max MB per output file>] "
+              << "[-j <number of threads>] [-p(rint conversion progress)] [-g <specialized converter source>]"
               << std::endl;
 }
 
@@ -18,14 +23,28 @@ int main(int argc, char **argv)
 {
     std::string inputFile;
     std::string outputFile;
-    std::string treeName;
+    std::vector<std::string> treeNames = {};
+    Bool_t flagAllTrees = false;
+    int nThreads = 1;
+    Long64_t maxEntriesPerFile = 0;
+    Long64_t maxMBPerFile = 0;
     std::string compressionAlgo = "none";
     std::vector<std::string> dictionaries = {};
     std::vector<std::string> subBranches = {};
+    std::vector<std::string> excludedBranches = {};
+    int verbosity = 1;
+    std::vector<std::string> friendTrees = {};
+    std::string filterExpression;
+    std::vector<std::string> sortKeys = {};
+    Long64_t reorderWindow = 0;
+    std::string originalIndexField;
+    Bool_t flagReorderReport = false;
+    Bool_t flagStringDictEncoding = false;
     Bool_t flagDefaultProgressCallbackFunc = false;
+    std::string converterSource;
 
     int inputArg;
-    while ((inputArg = getopt(argc, argv, "hi:o:c:d:b:t:s:p")) != -1)
+    while ((inputArg = getopt(argc, argv, "hi:o:c:d:b:t:s:paj:f:e:n:m:x:vk:w:I:REg:")) != -1)
     {
         switch (inputArg)
         {
@@ -47,12 +66,54 @@ int main(int argc, char **argv)
         case 's':
             subBranches.push_back(optarg);
             break;
+        case 'x':
+            excludedBranches.push_back(optarg);
+            break;
+        case 'v':
+            verbosity = 2;
+            break;
         case 't':
-            treeName = optarg;
+            treeNames.push_back(optarg);
+            break;
+        case 'a':
+            flagAllTrees = true;
+            break;
+        case 'f':
+            friendTrees.push_back(optarg);
+            break;
+        case 'e':
+            filterExpression = optarg;
+            break;
+        case 'k':
+            sortKeys.push_back(optarg);
+            break;
+        case 'w':
+            reorderWindow = std::stoll(optarg);
+            break;
+        case 'I':
+            originalIndexField = optarg;
+            break;
+        case 'R':
+            flagReorderReport = true;
+            break;
+        case 'E':
+            flagStringDictEncoding = true;
+            break;
+        case 'n':
+            maxEntriesPerFile = std::stoll(optarg);
+            break;
+        case 'm':
+            maxMBPerFile = std::stoll(optarg);
+            break;
+        case 'j':
+            nThreads = std::stoi(optarg);
             break;
         case 'p':
             flagDefaultProgressCallbackFunc = true;
             break;
+        case 'g':
+            converterSource = optarg;
+            break;
         default:
             fprintf(stderr, "Unknown option: -%c\n", inputArg);
             Usage(argv[0]);
@@ -60,16 +121,47 @@ int main(int argc, char **argv)
         }
     }
 
-    if (inputFile.empty() || outputFile.empty() || treeName.empty())
+    if (inputFile.empty() || (outputFile.empty() && converterSource.empty()) || (treeNames.empty() && !flagAllTrees))
     {
-        std::cerr<<"Error: Minimal required parameters: -i <input.root> -o <output.ntuple> -t(ree) <tree name>"<<std::endl;
+        std::cerr<<"Error: Minimal required parameters: -i <input.root> -o <output.ntuple> | -g <specialized converter source> -t(ree) <tree name> | -a(ll trees)"<<std::endl;
         exit(1);
     }
 
-    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>(inputFile, outputFile, treeName);
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>(inputFile, outputFile, flagAllTrees ? "" : treeNames.front());
+    conversion->SetVerbosity(verbosity);
+    if (flagAllTrees)
+        conversion->SelectAllTrees();
+    else
+        conversion->SetTreeNames(treeNames);
+    conversion->SetNumThreads(nThreads);
+    conversion->SetMaxEntriesPerFile(maxEntriesPerFile);
+    conversion->SetMaxBytesPerFile(maxMBPerFile * 1024 * 1024);
+    for (auto &f : friendTrees)
+    {
+        // [<main tree>:]<friend tree>[@<file name>]; the main tree defaults to the first tree given by -t
+        auto colon = f.find(':');
+        if (colon == std::string::npos && flagAllTrees)
+        {
+            std::cerr << "Error: with -a, the main tree of friend tree '" << f << "' has to be given as -f <main tree>:<friend tree>" << std::endl;
+            exit(1);
+        }
+        std::string mainTree = colon == std::string::npos ? treeNames.front() : f.substr(0, colon);
+        std::string friendTree = colon == std::string::npos ? f : f.substr(colon + 1);
+        auto at = friendTree.find('@');
+        if (at == std::string::npos)
+            conversion->AddFriendTree(mainTree, friendTree);
+        else
+            conversion->AddFriendTree(mainTree, friendTree.substr(0, at), friendTree.substr(at + 1));
+    }
     conversion->SetCompressionAlgo(compressionAlgo);
     conversion->SetDictionary(dictionaries);
     conversion->SelectBranches(subBranches);
+    conversion->ExcludeBranches(excludedBranches);
+    if (!filterExpression.empty())
+        conversion->SetFilter(filterExpression);
+    conversion->SetReorder(sortKeys, reorderWindow);
+    conversion->SetOriginalIndexField(originalIndexField);
+    conversion->SetStringDictionaryEncoding(flagStringDictEncoding);
     if (flagDefaultProgressCallbackFunc)
         conversion->SetUserProgressCallbackFunc([](int current, int total)
                                                 {
@@ -86,7 +178,56 @@ int main(int argc, char **argv)
                     current, total,
                     (static_cast<float>(current) / total) * 100);
         } });
+    if (!converterSource.empty())
+    {
+        conversion->GenerateConverterSource(converterSource);
+        return 0;
+    }
+
+    auto start = std::chrono::steady_clock::now();
     conversion->Convert();
+    if (verbosity >= 1)
+    {
+        Long64_t nEntries = 0;
+        for (auto &piece : conversion->GetOutputPieces())
+            nEntries += piece.nEntries;
+        Double_t seconds = std::chrono::duration<Double_t>(std::chrono::steady_clock::now() - start).count();
+        printf("Converted %lld entries in %.2f s (%.0f entries/s).\n", nEntries, seconds, nEntries / seconds);
+    }
+
+    if (flagReorderReport && !sortKeys.empty())
+    {
+        // Convert once more without reordering into temporary files and compare field by field
+        auto sortedPieces = conversion->GetOutputPieces();
+        conversion->SetReorder({}, 0);
+        conversion->SetOutputFile(outputFile + ".unsorted");
+        conversion->SetUserProgressCallbackFunc(nullptr);
+        conversion->SetVerbosity(0);
+        conversion->Convert();
+        auto unsortedPieces = conversion->GetOutputPieces();
+
+        std::map<std::pair<std::string, std::string>, std::pair<ULong64_t, ULong64_t>> fieldSizes;
+        for (auto &piece : unsortedPieces)
+        {
+            for (auto &[field, nBytes] : TTreeToRNTuple::GetFieldSizes(piece.fileName, piece.ntupleName))
+                fieldSizes[{piece.ntupleName, field}].first += nBytes;
+            gSystem->Unlink(piece.fileName.c_str());
+        }
+        gSystem->Unlink(conversion->GetManifestFile().c_str());
+        for (auto &piece : sortedPieces)
+        {
+            for (auto &[field, nBytes] : TTreeToRNTuple::GetFieldSizes(piece.fileName, piece.ntupleName))
+                fieldSizes[{piece.ntupleName, field}].second += nBytes;
+        }
+
+        printf("Compressed size per field, unsorted -> sorted:\n");
+        for (auto &[name, nBytes] : fieldSizes)
+        {
+            printf("  %s.%s: %llu -> %llu bytes (%+.1f%%)\n", name.first.c_str(), name.second.c_str(),
+                   nBytes.first, nBytes.second,
+                   nBytes.first > 0 ? (static_cast<double>(nBytes.second) / nBytes.first - 1) * 100 : 0.);
+        }
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -16,12 +16,22 @@
 #include <TSystem.h>
 #include <TInterpreter.h>
 #include <TError.h>
+#include <TKey.h>
+#include <TTreeFormula.h>
+#include <ROOT/RVec.hxx>
+
+#include <fnmatch.h>
 
 #include <cstring>
+#include <fstream>
 #include <iostream>
+#include <algorithm>
+#include <chrono>
 #include <map>
 #include <memory>
+#include <regex>
 #include <set>
+#include <sstream>
 #include <string>
 #include <vector>
 #include <utility>
@@ -36,36 +46,92 @@ using RNTupleWriteOptions = ROOT::Experimental::RNTupleWriteOptions;
 using RNTupleWriter = ROOT::Experimental::RNTupleWriter;
 using RCompressionSetting = ROOT::RCompressionSetting;
 using RException = ROOT::Experimental::RException;
+using RNTupleReader = ROOT::Experimental::RNTupleReader;
 
 TTreeToRNTuple::TTreeToRNTuple(std::string input, std::string output, std::string treeName)
 {
     fInputFile = input;
     fOutputFile = output;
-    fTreeName = treeName;
+    fTreeNames = {treeName};
+    fVerbosity = 1;
     SetCompressionAlgo("none");
     SetUserProgressCallbackFunc(nullptr);
     fSelectedBranches = {};
+    fExcludedBranches = {};
+    fNumThreads = 1;
+    fCacheSize = -1;
+    fMaxEntriesPerFile = 0;
+    fMaxBytesPerFile = 0;
+    fSortKeys = {};
+    fReorderWindow = 0;
+    fReorderMemory = 256 * 1024 * 1024;
+    fOriginalIndexField = "";
+    SetStringDictionaryEncoding(kFALSE);
+    fCommitInterval = 0;
+    fStreamTree = nullptr;
+    ClearFilter();
 }
 
 TTreeToRNTuple::TTreeToRNTuple(std::string input, std::string output, std::string treeName, std::string compressionAlgo, int compressionLevel)
 {
     fInputFile = input;
     fOutputFile = output;
-    fTreeName = treeName;
+    fTreeNames = {treeName};
+    fVerbosity = 1;
     SetCompressionAlgoLevel(compressionAlgo, compressionLevel);
     SetUserProgressCallbackFunc(nullptr);
     fSelectedBranches = {};
+    fExcludedBranches = {};
+    fNumThreads = 1;
+    fCacheSize = -1;
+    fMaxEntriesPerFile = 0;
+    fMaxBytesPerFile = 0;
+    fSortKeys = {};
+    fReorderWindow = 0;
+    fReorderMemory = 256 * 1024 * 1024;
+    fOriginalIndexField = "";
+    SetStringDictionaryEncoding(kFALSE);
+    fCommitInterval = 0;
+    fStreamTree = nullptr;
+    ClearFilter();
 }
 
 TTreeToRNTuple::TTreeToRNTuple(std::string input, std::string output, std::string treeName, std::string compressionAlgo, int compressionLevel, std::vector<std::string> dictionary)
 {
     fInputFile = input;
     fOutputFile = output;
-    fTreeName = treeName;
+    fTreeNames = {treeName};
+    fVerbosity = 1;
     SetCompressionAlgoLevel(compressionAlgo, compressionLevel);
     SetDictionary(dictionary);
     SetUserProgressCallbackFunc(nullptr);
     fSelectedBranches = {};
+    fExcludedBranches = {};
+    fNumThreads = 1;
+    fCacheSize = -1;
+    fMaxEntriesPerFile = 0;
+    fMaxBytesPerFile = 0;
+    fSortKeys = {};
+    fReorderWindow = 0;
+    fReorderMemory = 256 * 1024 * 1024;
+    fOriginalIndexField = "";
+    SetStringDictionaryEncoding(kFALSE);
+    fCommitInterval = 0;
+    fStreamTree = nullptr;
+    ClearFilter();
+}
+
+TTreeToRNTuple::~TTreeToRNTuple()
+{
+    // Closing the last piece can fail, e.g. on a full disk, and a destructor must not throw
+    try
+    {
+        Detach();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << "Closing the streamed output failed: " << e.what() << std::endl;
+    }
 }
 
 std::string TTreeToRNTuple::SanitizeBranchName(std::string name)
@@ -142,7 +208,8 @@ void TTreeToRNTuple::SetDictionary(std::vector<std::string> dictionary)
         int loadStatus = gSystem->Load(d.c_str());
         if (loadStatus == 0 || loadStatus == 1)
         {
-            printf("Load dictionary \'%s\' successfully!\n", d.c_str());
+            if (fVerbosity >= 1)
+                printf("Load dictionary \'%s\' successfully!\n", d.c_str());
         }
         else
         {
@@ -152,22 +219,103 @@ void TTreeToRNTuple::SetDictionary(std::vector<std::string> dictionary)
     fDictionary = dictionary;
 }
 
+void TTreeToRNTuple::AddBranchPattern(BranchMatcher &matcher, std::string pattern)
+{
+    if (pattern.size() > 2 && pattern.front() == '/' && pattern.back() == '/')
+    {
+        try
+        {
+            matcher.regexes.emplace_back(pattern.substr(1, pattern.size() - 2));
+        }
+        catch (const std::regex_error &e)
+        {
+            throw RException(R__FAIL("Branch pattern \'" + pattern + "\' is not a valid regular expression: " + e.what() + "\n"));
+        }
+    }
+    else if (pattern.find_first_of("*?[") != std::string::npos)
+    {
+        matcher.globs.push_back(SanitizeBranchName(pattern));
+    }
+    else
+    {
+        matcher.names.insert(SanitizeBranchName(pattern));
+    }
+}
+
+Bool_t TTreeToRNTuple::MatchBranch(const BranchMatcher &matcher, const std::string &branchName, const std::string &ntupleName)
+{
+    if (matcher.names.count(ntupleName))
+    {
+        return kTRUE;
+    }
+    for (const auto &glob : matcher.globs)
+    {
+        if (fnmatch(glob.c_str(), ntupleName.c_str(), 0) == 0)
+        {
+            return kTRUE;
+        }
+    }
+    for (const auto &regex : matcher.regexes)
+    {
+        if (std::regex_search(branchName, regex) || std::regex_search(ntupleName, regex))
+        {
+            return kTRUE;
+        }
+    }
+    return kFALSE;
+}
+
+Bool_t TTreeToRNTuple::IsSelectingAllBranches()
+{
+    return fSelectedBranches.names.empty() && fSelectedBranches.globs.empty() && fSelectedBranches.regexes.empty() &&
+           fExcludedBranches.names.empty() && fExcludedBranches.globs.empty() && fExcludedBranches.regexes.empty();
+}
+
+Bool_t TTreeToRNTuple::IsBranchSelected(const std::string &branchName, const std::string &ntupleName)
+{
+    Bool_t selectAll = fSelectedBranches.names.empty() && fSelectedBranches.globs.empty() && fSelectedBranches.regexes.empty();
+    if (!selectAll && !MatchBranch(fSelectedBranches, branchName, ntupleName))
+    {
+        return kFALSE;
+    }
+    return !MatchBranch(fExcludedBranches, branchName, ntupleName);
+}
+
 void TTreeToRNTuple::SelectBranches(std::vector<std::string> subBranch)
 {
     for (auto sb : subBranch)
     {
-        fSelectedBranches.push_back(SanitizeBranchName(sb));
+        AddBranchPattern(fSelectedBranches, sb);
+    }
+}
+
+void TTreeToRNTuple::ExcludeBranches(std::vector<std::string> excludedBranch)
+{
+    for (auto eb : excludedBranch)
+    {
+        AddBranchPattern(fExcludedBranches, eb);
     }
 }
 
 void TTreeToRNTuple::SelectAllBranches()
 {
     fSelectedBranches = {};
+    fExcludedBranches = {};
 }
 
 void TTreeToRNTuple::SetTreeName(std::string treeName)
 {
-    fTreeName = treeName;
+    fTreeNames = {treeName};
+}
+
+void TTreeToRNTuple::SetTreeNames(std::vector<std::string> treeNames)
+{
+    fTreeNames = treeNames;
+}
+
+void TTreeToRNTuple::SelectAllTrees()
+{
+    fTreeNames = {};
 }
 
 void TTreeToRNTuple::SetInputFile(std::string input)
@@ -185,146 +333,1464 @@ void TTreeToRNTuple::SetUserProgressCallbackFunc(callback_t notify)
     fCallbackFunc = notify;
 }
 
+void TTreeToRNTuple::AddFriendTree(std::string mainTreeName, std::string treeName, std::string fileName, std::string alias)
+{
+    fFriendTrees.push_back({mainTreeName, treeName, fileName, alias.empty() ? treeName : alias});
+}
+
+void TTreeToRNTuple::ClearFriendTrees()
+{
+    fFriendTrees = {};
+}
+
+void TTreeToRNTuple::SetFilter(std::string expression)
+{
+    fFilterExpression = expression;
+}
+
+void TTreeToRNTuple::SetFilter(std::vector<std::string> branches, filter_t predicate)
+{
+    fFilterBranches = branches;
+    fFilterFunc = predicate;
+}
+
+void TTreeToRNTuple::ClearFilter()
+{
+    fFilterExpression = "";
+    fFilterBranches = {};
+    fFilterFunc = nullptr;
+}
+
+void TTreeToRNTuple::SetMaxEntriesPerFile(Long64_t maxEntries)
+{
+    fMaxEntriesPerFile = maxEntries;
+}
+
+void TTreeToRNTuple::SetMaxBytesPerFile(Long64_t maxBytes)
+{
+    fMaxBytesPerFile = maxBytes;
+}
+
+void TTreeToRNTuple::SetReorder(std::vector<std::string> keyBranches, Long64_t windowEntries)
+{
+    fSortKeys = keyBranches;
+    fReorderWindow = windowEntries;
+}
+
+void TTreeToRNTuple::SetReorderMemory(Long64_t maxBytes)
+{
+    fReorderMemory = maxBytes;
+}
+
+void TTreeToRNTuple::SetOriginalIndexField(std::string fieldName)
+{
+    fOriginalIndexField = fieldName;
+}
+
+void TTreeToRNTuple::SetStringDictionaryEncoding(Bool_t enable, Long64_t sampleEntries, UInt_t maxCardinality)
+{
+    fStringDictEncoding = enable;
+    fStringDictSampleEntries = sampleEntries;
+    fStringDictMaxCardinality = maxCardinality;
+}
+
+void TTreeToRNTuple::SetCommitInterval(Double_t seconds)
+{
+    fCommitInterval = seconds;
+}
+
+void TTreeToRNTuple::SetVerbosity(int verbosity)
+{
+    fVerbosity = verbosity;
+}
+
+void TTreeToRNTuple::SetNumThreads(int nThreads)
+{
+    fNumThreads = nThreads;
+}
+
+void TTreeToRNTuple::SetCacheSize(Long64_t cacheSize)
+{
+    fCacheSize = cacheSize;
+}
+
+std::vector<std::string> TTreeToRNTuple::FindTreeNames(TFile &file)
+{
+    // Keys of the same tree appear once per cycle; only the name is kept.
+    // Friend trees of the input file are converted as part of their main tree, not on their own.
+    std::vector<std::string> treeNames;
+    std::set<std::string> seen;
+    for (const auto &fr : fFriendTrees)
+    {
+        if (fr.fileName.empty() || fr.fileName == fInputFile)
+        {
+            seen.insert(fr.treeName);
+        }
+    }
+    for (auto key : TRangeDynCast<TKey>(*file.GetListOfKeys()))
+    {
+        auto kClass = TClass::GetClass(key->GetClassName());
+        if (!kClass || !kClass->InheritsFrom(TTree::Class()))
+        {
+            continue;
+        }
+        if (seen.insert(key->GetName()).second)
+        {
+            treeNames.push_back(key->GetName());
+        }
+    }
+    return treeNames;
+}
+
 void TTreeToRNTuple::Convert()
 {
     std::unique_ptr<TFile> file(TFile::Open(fInputFile.c_str()));
 
     R__ASSERT(file && !file->IsZombie());
 
-    auto tree = file->Get<TTree>(fTreeName.c_str());
-    if (!tree)
+    auto treeNames = fTreeNames.empty() ? FindTreeNames(*file) : fTreeNames;
+    if (treeNames.empty())
     {
-        throw RException(R__FAIL("Tree \'" + fTreeName + "\' is not found!\n"));
+        throw RException(R__FAIL("No tree is found in \'" + fInputFile + "\'!\n"));
     }
 
-    Long_t nEntries = tree->GetEntries();
-    printf("Number of entries in tree \'%s\': %ld.\n", fTreeName.c_str(), nEntries);
+    // Basket decompression of the input branches and page compression of the output columns
+    // are spread over the ROOT thread pool; all trees share the input and output file handles.
+    // The pool is process-wide, so it is only enabled for the conversion if the caller has not done so.
+    Bool_t enableMT = fNumThreads > 1 && !ROOT::IsImplicitMTEnabled();
+    if (enableMT)
+    {
+        ROOT::EnableImplicitMT(fNumThreads);
+    }
 
-    //
-    // Get the scheme of the tree
-    //
-    for (auto branch : TRangeDynCast<TBranch>(*tree->GetListOfBranches()))
+    try
     {
-        R__ASSERT(branch);
-        R__ASSERT(branch->GetNleaves() == 1);
-        if (!fSelectedBranches.empty() && std::find(fSelectedBranches.begin(), fSelectedBranches.end(), SanitizeBranchName(branch->GetName())) == fSelectedBranches.end())
+        fNumOutputFiles = 0;
+        fOutputPieces.clear();
+        OpenOutputFile();
+
+        for (const auto &treeName : treeNames)
         {
-            continue;
+            ConvertTree(*file, treeName);
         }
+        fOutput.reset();
+    }
+    catch (...)
+    {
+        if (enableMT)
+            ROOT::DisableImplicitMT();
+        throw;
+    }
+    if (enableMT)
+    {
+        ROOT::DisableImplicitMT();
+    }
+
+    if (IsRollingOutput())
+    {
+        WriteManifest();
+    }
+}
+
+Bool_t TTreeToRNTuple::IsRollingOutput()
+{
+    // The commit interval only applies to streaming; Convert() never rolls over by time
+    return fMaxEntriesPerFile > 0 || fMaxBytesPerFile > 0 || (fStreamTree && fCommitInterval > 0);
+}
+
+std::string TTreeToRNTuple::GetOutputFileName(int index)
+{
+    if (!IsRollingOutput())
+    {
+        return fOutputFile;
+    }
+    // 'out.ntuple' -> 'out_0.ntuple', 'out_1.ntuple', ...
+    auto slash = fOutputFile.find_last_of('/');
+    auto dot = fOutputFile.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    {
+        return fOutputFile + "_" + std::to_string(index);
+    }
+    return fOutputFile.substr(0, dot) + "_" + std::to_string(index) + fOutputFile.substr(dot);
+}
+
+std::string TTreeToRNTuple::GetManifestFile()
+{
+    auto slash = fOutputFile.find_last_of('/');
+    auto dot = fOutputFile.find_last_of('.');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    {
+        return fOutputFile + ".manifest.json";
+    }
+    return fOutputFile.substr(0, dot) + ".manifest.json";
+}
+
+void TTreeToRNTuple::OpenOutputFile()
+{
+    fOutput.reset();
+    std::string fileName = GetOutputFileName(fNumOutputFiles++);
+    fOutput.reset(TFile::Open(fileName.c_str(), "RECREATE"));
+    if (!fOutput || fOutput->IsZombie())
+    {
+        throw RException(R__FAIL("Output file \'" + fileName + "\' cannot be created!\n"));
+    }
+}
+
+Bool_t TTreeToRNTuple::RollOverPending()
+{
+    if (fMaxEntriesPerFile > 0 && fOutputPieces.back().nEntries >= fMaxEntriesPerFile)
+    {
+        return kTRUE;
+    }
+    // Pages are written when a cluster is committed, so the file only grows at cluster boundaries
+    return fMaxBytesPerFile > 0 && fOutputPieces.back().nEntries > 0 && fOutput->GetEND() >= fMaxBytesPerFile;
+}
 
-        TLeaf *leaf = static_cast<TLeaf *>(branch->GetListOfLeaves()->First());
-        std::cout << "In input file \'" << file->GetName() << "\' detect leaf name: " << leaf->GetName() << "; leaf type: " << leaf->GetTypeName() << "; leaf title: " << leaf->GetTitle()
-                  << "; leaf length: " << leaf->GetLenStatic() << "; leaf type size: " << leaf->GetLenType() << std::endl;
+void TTreeToRNTuple::WriteManifest()
+{
+    // Readers may poll the manifest while it is rewritten, so it is replaced by a rename rather than in place
+    std::string manifestFile = GetManifestFile();
+    std::string temporaryFile = manifestFile + ".tmp";
+    std::ofstream manifest(temporaryFile);
+    if (!manifest)
+    {
+        throw RException(R__FAIL("Manifest file \'" + temporaryFile + "\' cannot be created!\n"));
+    }
+    manifest << "{\n  \"pieces\": [";
+    for (decltype(fOutputPieces.size()) k = 0; k < fOutputPieces.size(); k++)
+    {
+        const auto &piece = fOutputPieces[k];
+        manifest << (k == 0 ? "\n" : ",\n")
+                 << "    {\"ntuple\": \"" << EscapeJson(piece.ntupleName) << "\", \"file\": \"" << EscapeJson(piece.fileName)
+                 << "\", \"firstEntry\": " << piece.firstEntry << ", \"nEntries\": " << piece.nEntries << "}";
+    }
+    manifest << "\n  ]\n}\n";
+    manifest.close();
+    if (!manifest || gSystem->Rename(temporaryFile.c_str(), manifestFile.c_str()) != 0)
+    {
+        throw RException(R__FAIL("Manifest file \'" + manifestFile + "\' cannot be written!\n"));
+    }
+    if (fVerbosity >= 1)
+        printf("Write manifest of %zu output pieces to \'%s\'.\n", fOutputPieces.size(), manifestFile.c_str());
+}
 
-        if (typeid(*branch) == typeid(TBranchSTL) || typeid(*branch) == typeid(TBranchElement))
+std::string TTreeToRNTuple::EscapeJson(const std::string &value)
+{
+    std::string escaped;
+    for (unsigned char c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (c < 0x20)
         {
-            fContainerFields.push_back({leaf->GetName(), SanitizeBranchName(leaf->GetName()), leaf->GetTypeName()});
+            char code[7];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
         }
         else
         {
-            //  If this leaf stores a variable-sized array or a multi-dimensional array whose last dimension has variable size,
-            //  return a pointer to the TLeaf that stores such size. Return a nullptr otherwise.
-            auto szLeaf = leaf->GetLeafCount();
-            if (szLeaf)
-            {
-                // string treeName, string ntupleName, string typeName, int leafTypeSize, bool isVariableSizedArray, int arrayLength
-                fFlatFields.push_back({leaf->GetName(), SanitizeBranchName(leaf->GetName()), leaf->GetTypeName(), leaf->GetLenType(), kTRUE, szLeaf->GetMaximum()});
-            }
-            else
-            {
-                fFlatFields.push_back({leaf->GetName(), SanitizeBranchName(leaf->GetName()), leaf->GetTypeName(), leaf->GetLenType(), kFALSE, leaf->GetLenStatic()});
-            }
+            escaped += c;
         }
     }
+    return escaped;
+}
 
-    auto model = RNTupleModel::CreateBare();
+std::unique_ptr<REntry> TTreeToRNTuple::BindEntry(RNTupleModel &model)
+{
+    // The addresses are listed in the order BuildModel() adds the fields
+    std::vector<void *> addresses;
+    addresses.reserve(fFlatFields.size() + fContainerFields.size() + 1);
     for (auto &f1 : fFlatFields)
     {
-        if (f1.isVariableSizedArray) // variable-size array
+        if (f1.isVariableSizedArray)
+        {
+            addresses.push_back(&f1.ntupleBuffer);
+        }
+        else
+        {
+            addresses.push_back(f1.address);
+        }
+    }
+    for (auto &c1 : fContainerFields)
+    {
+        if (!c1.stringDictionary)
         {
-            auto field = RFieldBase::Create(f1.ntupleName, "std::vector<" + f1.typeName + ", " + std::to_string(f1.arrayLength) + ">").Unwrap();
-            R__ASSERT(field);
-            model->AddField(std::move(field));
-            std::cout << "Add field: " << model->GetField(f1.ntupleName)->GetName() << "; field type name: " << model->GetField(f1.ntupleName)->GetType() << std::endl;
-            f1.treeBuffer = std::make_unique<unsigned char[]>(f1.arrayLength * f1.leafTypeSize);
-            tree->SetBranchAddress(f1.ntupleName.c_str(), (void *)f1.treeBuffer.get());
+            addresses.push_back(c1.address);
         }
-        else if (!f1.isVariableSizedArray && f1.arrayLength > 1) // normal fixed-size array
+        else if (c1.stringDictionary->kind == kString)
         {
-            auto field = RFieldBase::Create(f1.ntupleName, "std::array<" + f1.typeName + ", " + std::to_string(f1.arrayLength) + ">").Unwrap();
-            R__ASSERT(field);
-            model->AddField(std::move(field));
-            std::cout << "Add field: " << model->GetField(f1.ntupleName)->GetName() << "; field type name: " << model->GetField(f1.ntupleName)->GetType() << std::endl;
-            f1.treeBuffer = std::make_unique<unsigned char[]>(f1.arrayLength * f1.leafTypeSize);
-            tree->SetBranchAddress(f1.ntupleName.c_str(), (void *)f1.treeBuffer.get());
+            addresses.push_back(&c1.stringDictionary->encoded);
         }
-        else if (!f1.isVariableSizedArray && f1.arrayLength == 1) // normal single variable
+        else
         {
-            auto field = RFieldBase::Create(f1.ntupleName, f1.typeName).Unwrap();
-            R__ASSERT(field);
-            model->AddField(std::move(field));
-            std::cout << "Add field: " << model->GetField(f1.ntupleName)->GetName() << "; field type name: " << model->GetField(f1.ntupleName)->GetType() << std::endl;
-            f1.treeBuffer = std::make_unique<unsigned char[]>(f1.arrayLength * f1.leafTypeSize);
-            tree->SetBranchAddress(f1.ntupleName.c_str(), (void *)f1.treeBuffer.get());
+            addresses.push_back(&c1.stringDictionary->encodedStrings);
         }
     }
-    for (auto &c1 : fContainerFields)
+    if (!fOriginalIndexField.empty())
     {
-        auto field = RFieldBase::Create(c1.ntupleName, c1.typeName).Unwrap();
-        R__ASSERT(field);
-        model->AddField(std::move(field));
-        std::cout << "Add field: " << model->GetField(c1.ntupleName)->GetName() << "; field type name: " << model->GetField(c1.ntupleName)->GetType() << std::endl;
-        auto kClass = TClass::GetClass(c1.typeName.c_str());
-        c1.treeBuffer = std::make_shared<void *>(nullptr);
-        tree->SetBranchAddress(c1.treeName.c_str(), c1.treeBuffer.get(), kClass, EDataType::kOther_t, true);
+        addresses.push_back(&fOriginalIndex);
     }
-    model->Freeze();
 
-    auto entry = model->CreateBareEntry();
-    for (auto &f1 : fFlatFields)
+    // The values of a bare entry follow the order of the fields, so they are captured by position;
+    // REntry::CaptureValueUnsafe() looks every field up by name, which is quadratic for wide trees
+    auto entry = model.CreateBareEntry();
+    auto value = entry->begin();
+    for (auto address : addresses)
     {
-        if (f1.isVariableSizedArray)
+        R__ASSERT(value != entry->end());
+        *value = value->GetField()->CaptureValue(address);
+        ++value;
+    }
+    R__ASSERT(value == entry->end());
+    return entry;
+}
+
+void TTreeToRNTuple::SetBranchProcessing(TBranch *branch, Bool_t process)
+{
+    if (process)
+    {
+        branch->ResetBit(TBranch::kDoNotProcess);
+    }
+    else
+    {
+        branch->SetBit(TBranch::kDoNotProcess);
+    }
+    for (auto subBranch : TRangeDynCast<TBranch>(*branch->GetListOfBranches()))
+    {
+        SetBranchProcessing(subBranch, process);
+    }
+}
+
+void TTreeToRNTuple::CacheBranches(const std::vector<std::pair<TTree *, std::string>> &trees, const std::vector<TBranch *> &extraBranches)
+{
+    // Registering branches with the TTreeCache one by one is quadratic in their number. Instead, the branches
+    // that are not needed are switched off, which TTree::GetEntry() skips as well, and the remaining ones
+    // are registered in one pass.
+    if (!IsSelectingAllBranches())
+    {
+        for (auto &t : trees)
         {
-            f1.ntupleBuffer = std::make_unique<unsigned char[]>(f1.arrayLength * f1.leafTypeSize);
-            entry->CaptureValueUnsafe(f1.ntupleName, f1.ntupleBuffer.get());
+            for (auto branch : TRangeDynCast<TBranch>(*t.first->GetListOfBranches()))
+            {
+                SetBranchProcessing(branch, kFALSE);
+            }
         }
-        else
+        auto enable = [this](TBranch *branch)
+        {
+            SetBranchProcessing(branch->GetMother(), kTRUE);
+            auto leaf = static_cast<TLeaf *>(branch->GetListOfLeaves()->First());
+            if (leaf && leaf->GetLeafCount())
+            {
+                SetBranchProcessing(leaf->GetLeafCount()->GetBranch()->GetMother(), kTRUE);
+            }
+        };
+        for (auto &f1 : fFlatFields)
+        {
+            enable(f1.leaf->GetBranch());
+        }
+        for (auto &c1 : fContainerFields)
+        {
+            enable(c1.branch);
+        }
+        for (auto branch : extraBranches)
         {
-            entry->CaptureValueUnsafe(f1.ntupleName, f1.treeBuffer.get());
+            enable(branch);
         }
     }
-    for (auto &c1 : fContainerFields)
+    for (auto &t : trees)
     {
-        entry->CaptureValueUnsafe(c1.ntupleName, *c1.treeBuffer.get());
+        t.first->AddBranchToCache("*", kTRUE);
+        t.first->StopCacheLearningPhase();
     }
+}
 
-    // Create the RNTuple file
-    auto ntuple = RNTupleWriter::Recreate(std::move(model), fTreeName, fOutputFile, fWriteOptions);
+void TTreeToRNTuple::SortWindow(const std::vector<TLeaf *> &keyLeaves, Long64_t windowStart, Long64_t windowEnd,
+                                std::vector<Long64_t> &window, std::vector<SortKey> &keys)
+{
+    static const std::set<std::string> realTypes = {"Float_t", "Double_t", "Float16_t", "Double32_t", "float", "double"};
+    auto nKeys = keyLeaves.size();
+    std::vector<ESortKeyKind> kinds;
+    for (auto leaf : keyLeaves)
+    {
+        kinds.push_back(realTypes.count(leaf->GetTypeName()) ? kRealKey : (leaf->IsUnsigned() ? kUnsignedKey : kSignedKey));
+    }
 
-    // Loop the tree
-    decltype(nEntries) i = 0;
-    for (i = 0; i < nEntries; i++)
+    // Only the key branches are read here; the buffers are reused from window to window
+    window.resize(windowEnd - windowStart);
+    keys.resize(window.size() * nKeys);
+    for (Long64_t j = 0; j < windowEnd - windowStart; j++)
+    {
+        window[j] = j;
+        for (decltype(nKeys) k = 0; k < nKeys; k++)
+        {
+            keyLeaves[k]->GetBranch()->GetEntry(windowStart + j);
+            if (kinds[k] == kRealKey)
+                keys[j * nKeys + k].real = keyLeaves[k]->GetValue(0);
+            else
+                keys[j * nKeys + k].integer = keyLeaves[k]->GetValueLong64(0); // same bits for ULong64_t
+        }
+    }
+    std::stable_sort(window.begin(), window.end(), [&keys, &kinds, nKeys](Long64_t a, Long64_t b)
+                     {
+        for (decltype(nKeys) k = 0; k < nKeys; k++)
+        {
+            const auto &x = keys[a * nKeys + k];
+            const auto &y = keys[b * nKeys + k];
+            Bool_t less = kinds[k] == kRealKey       ? x.real < y.real
+                          : kinds[k] == kUnsignedKey ? x.unsignedInteger < y.unsignedInteger
+                                                     : x.integer < y.integer;
+            Bool_t greater = kinds[k] == kRealKey       ? y.real < x.real
+                             : kinds[k] == kUnsignedKey ? y.unsignedInteger < x.unsignedInteger
+                                                        : y.integer < x.integer;
+            if (less || greater)
+                return static_cast<bool>(less);
+        }
+        return false; });
+    for (auto &j : window)
     {
-        tree->GetEntry(i);
+        j += windowStart;
+    }
+}
 
-        for (auto &f1 : fFlatFields)
+std::map<std::string, ULong64_t> TTreeToRNTuple::GetFieldSizes(std::string fileName, std::string ntupleName)
+{
+    // Sum of the compressed page sizes of all columns below each top-level field
+    std::map<std::string, ULong64_t> fieldSizes;
+    auto reader = RNTupleReader::Open(ntupleName, fileName);
+    const auto &descriptor = *reader->GetDescriptor();
+    for (const auto &topLevelField : descriptor.GetTopLevelFields())
+    {
+        std::vector<ROOT::Experimental::DescriptorId_t> fieldIds = {topLevelField.GetId()};
+        ULong64_t nBytes = 0;
+        while (!fieldIds.empty())
         {
-            if (f1.isVariableSizedArray)
+            auto fieldId = fieldIds.back();
+            fieldIds.pop_back();
+            for (const auto &subField : descriptor.GetFieldIterable(fieldId))
+            {
+                fieldIds.push_back(subField.GetId());
+            }
+            for (const auto &column : descriptor.GetColumnIterable(fieldId))
             {
-                Int_t arrayLengthCurrentEntry = tree->GetBranch(f1.treeName.c_str())->GetLeaf(f1.treeName.c_str())->GetLen();
-                ((std::vector<unsigned char> *)f1.ntupleBuffer.get())->resize(arrayLengthCurrentEntry * f1.leafTypeSize);
-                std::memcpy(((std::vector<unsigned char> *)f1.ntupleBuffer.get())->data(), f1.treeBuffer.get(), arrayLengthCurrentEntry * f1.leafTypeSize);
+                for (const auto &cluster : descriptor.GetClusterIterable())
+                {
+                    if (!cluster.ContainsColumn(column.GetId()))
+                    {
+                        continue;
+                    }
+                    for (const auto &pageInfo : cluster.GetPageRange(column.GetId()).fPageInfos)
+                    {
+                        nBytes += pageInfo.fLocator.fBytesOnStorage;
+                    }
+                }
             }
         }
+        fieldSizes[topLevelField.GetFieldName()] = nBytes;
+    }
+    return fieldSizes;
+}
+
+EStringKind TTreeToRNTuple::GetStringKind(const std::string &typeName)
+{
+    static const std::map<std::string, EStringKind> kinds = {
+        {"string", kString},
+        {"std::string", kString},
+        {"vector<string>", kStringVector},
+        {"std::vector<std::string>", kStringVector},
+        {"ROOT::VecOps::RVec<string>", kStringRVec},
+        {"ROOT::VecOps::RVec<std::string>", kStringRVec},
+        {"ROOT::RVec<std::string>", kStringRVec}};
+    auto kind = kinds.find(typeName);
+    return kind == kinds.end() ? kNoString : kind->second;
+}
 
-        ntuple->Fill(*entry);
-        if (fCallbackFunc && i%1000==0 )
+Bool_t TTreeToRNTuple::IsLowCardinality(ContainerField &c1, EStringKind kind, Long64_t nEntries)
+{
+    // Decided on the first entries; the dictionary itself keeps growing if later entries bring new values
+    std::unordered_set<std::string> distinct;
+    Long64_t nValues = 0;
+    auto nSample = std::min(fStringDictSampleEntries, nEntries);
+    for (Long64_t j = 0; j < nSample; j++)
+    {
+        c1.branch->GetEntry(j);
+        if (kind == kString)
         {
-            fCallbackFunc(i, nEntries);
+            distinct.insert(*static_cast<std::string *>(c1.address));
+            nValues++;
+        }
+        else if (kind == kStringVector)
+        {
+            auto &values = *static_cast<std::vector<std::string> *>(c1.address);
+            distinct.insert(values.begin(), values.end());
+            nValues += values.size();
+        }
+        else
+        {
+            auto &values = *static_cast<ROOT::RVec<std::string> *>(c1.address);
+            distinct.insert(values.begin(), values.end());
+            nValues += values.size();
+        }
+        if (distinct.size() > fStringDictMaxCardinality)
+        {
+            return kFALSE;
         }
     }
-    if (fCallbackFunc)
+    return nValues > 0 && (Long64_t)distinct.size() * 10 <= nValues;
+}
+
+void TTreeToRNTuple::EncodeStrings(ContainerField &c1)
+{
+    auto &dict = *c1.stringDictionary;
+    auto encode = [&dict](const std::string &value)
+    {
+        auto it = dict.index.find(value);
+        if (it != dict.index.end())
+        {
+            return it->second;
+        }
+        std::uint32_t index = dict.values.size();
+        dict.index.emplace(value, index);
+        dict.values.push_back(value);
+        return index;
+    };
+    if (dict.kind == kString)
+    {
+        dict.encoded = encode(*static_cast<std::string *>(c1.address));
+    }
+    else if (dict.kind == kStringVector)
+    {
+        auto &values = *static_cast<std::vector<std::string> *>(c1.address);
+        dict.encodedStrings.resize(values.size());
+        for (decltype(values.size()) k = 0; k < values.size(); k++)
+        {
+            dict.encodedStrings[k] = encode(values[k]);
+        }
+    }
+    else
+    {
+        auto &values = *static_cast<ROOT::RVec<std::string> *>(c1.address);
+        dict.encodedStrings.resize(values.size());
+        for (decltype(values.size()) k = 0; k < values.size(); k++)
+        {
+            dict.encodedStrings[k] = encode(values[k]);
+        }
+    }
+}
+
+void TTreeToRNTuple::WriteStringDictionaries(const std::string &ntupleName)
+{
+    // Written into every output piece, so that each piece can be decoded on its own
+    for (auto &c1 : fContainerFields)
+    {
+        if (c1.stringDictionary)
+        {
+            fOutput->WriteObject(&c1.stringDictionary->values, GetStringDictionaryKey(ntupleName, c1.ntupleName).c_str());
+        }
+    }
+}
+
+std::string TTreeToRNTuple::GetStringDictionaryKey(std::string ntupleName, std::string fieldName)
+{
+    return ntupleName + "." + fieldName + ".dict";
+}
+
+std::vector<std::string> TTreeToRNTuple::ReadStringDictionary(std::string fileName, std::string ntupleName, std::string fieldName)
+{
+    std::unique_ptr<TFile> file(TFile::Open(fileName.c_str()));
+    R__ASSERT(file && !file->IsZombie());
+    auto dictionary = file->Get<std::vector<std::string>>(GetStringDictionaryKey(ntupleName, fieldName).c_str());
+    if (!dictionary)
+    {
+        throw RException(R__FAIL("Field \'" + fieldName + "\' of RNTuple \'" + ntupleName + "\' is not dictionary-encoded!\n"));
+    }
+    std::vector<std::string> values = std::move(*dictionary);
+    delete dictionary;
+    return values;
+}
+
+std::shared_ptr<void> TTreeToRNTuple::AcquireObject(TClass *kClass)
+{
+    if (!kClass)
+    {
+        throw RException(R__FAIL("Error: no dictionary is found for a container branch!\n"));
+    }
+    auto &pool = fObjectPool[kClass];
+    if (!pool.empty())
+    {
+        auto object = std::move(pool.back());
+        pool.pop_back();
+        return object;
+    }
+    return std::shared_ptr<void>(kClass->New(), [kClass](void *object)
+                                 { kClass->Destructor(object); });
+}
+
+void TTreeToRNTuple::ReleaseObjects()
+{
+    for (auto &c1 : fContainerFields)
+    {
+        if (c1.treeObject)
+        {
+            fObjectPool[c1.kClass].push_back(std::move(c1.treeObject));
+        }
+    }
+}
+
+void TTreeToRNTuple::DescribeTrees(const std::vector<std::pair<TTree *, std::string>> &trees)
+{
+    fFlatFields.clear();
+    fContainerFields.clear();
+
+    //
+    // Get the scheme of the tree and its friends
+    //
+    for (auto &[t, alias] : trees)
+    {
+        for (auto branch : TRangeDynCast<TBranch>(*t->GetListOfBranches()))
+        {
+            R__ASSERT(branch);
+            R__ASSERT(branch->GetNleaves() == 1);
+            std::string branchName = alias.empty() ? branch->GetName() : alias + "." + branch->GetName();
+            std::string ntupleName = SanitizeBranchName(branchName);
+            if (!IsBranchSelected(branchName, ntupleName))
+            {
+                continue;
+            }
+
+            TLeaf *leaf = static_cast<TLeaf *>(branch->GetListOfLeaves()->First());
+            if (fVerbosity >= 2)
+                std::cout << "In input file \'" << (t->GetCurrentFile() ? t->GetCurrentFile()->GetName() : "") << "\' detect leaf name: " << leaf->GetName() << "; leaf type: " << leaf->GetTypeName() << "; leaf title: " << leaf->GetTitle()
+                      << "; leaf length: " << leaf->GetLenStatic() << "; leaf type size: " << leaf->GetLenType() << std::endl;
+
+            if (typeid(*branch) == typeid(TBranchSTL) || typeid(*branch) == typeid(TBranchElement))
+            {
+                fContainerFields.push_back({leaf->GetName(), ntupleName, leaf->GetTypeName(), t, branch});
+            }
+            else
+            {
+                //  If this leaf stores a variable-sized array or a multi-dimensional array whose last dimension has variable size,
+                //  return a pointer to the TLeaf that stores such size. Return a nullptr otherwise.
+                auto szLeaf = leaf->GetLeafCount();
+                if (szLeaf)
+                {
+                    // string treeName, string ntupleName, string typeName, int leafTypeSize, bool isVariableSizedArray, int arrayLength, TTree *tree, TLeaf *leaf
+                    fFlatFields.push_back({leaf->GetName(), ntupleName, leaf->GetTypeName(), leaf->GetLenType(), kTRUE, szLeaf->GetMaximum(), t, leaf});
+                }
+                else
+                {
+                    fFlatFields.push_back({leaf->GetName(), ntupleName, leaf->GetTypeName(), leaf->GetLenType(), kFALSE, leaf->GetLenStatic(), t, leaf});
+                }
+            }
+        }
+    }
+}
+
+std::string TTreeToRNTuple::GetFieldType(const FlatField &f1)
+{
+    if (f1.isVariableSizedArray) // variable-size array
     {
-        fCallbackFunc(i, nEntries);
+        return "std::vector<" + f1.typeName + ", " + std::to_string(f1.arrayLength) + ">";
     }
-}
\ No newline at end of file
+    else if (!f1.isVariableSizedArray && f1.arrayLength > 1) // normal fixed-size array
+    {
+        return "std::array<" + f1.typeName + ", " + std::to_string(f1.arrayLength) + ">";
+    }
+    else // normal single variable
+    {
+        return f1.typeName;
+    }
+}
+
+std::unique_ptr<RNTupleModel> TTreeToRNTuple::BuildModel(Long64_t nEntries, Bool_t bindBranches)
+{
+    // Without bindBranches the fields read the values from the addresses already set on the branches
+    auto model = RNTupleModel::CreateBare();
+    for (auto &f1 : fFlatFields)
+    {
+        auto field = RFieldBase::Create(f1.ntupleName, GetFieldType(f1)).Unwrap();
+        R__ASSERT(field);
+        if (fVerbosity >= 2)
+            std::cout << "Add field: " << field->GetName() << "; field type name: " << field->GetType() << std::endl;
+        model->AddField(std::move(field));
+        if (f1.isVariableSizedArray)
+        {
+            f1.ntupleBuffer.reserve(f1.arrayLength * f1.leafTypeSize);
+        }
+        if (bindBranches)
+        {
+            f1.treeBuffer = std::make_unique<unsigned char[]>(f1.arrayLength * f1.leafTypeSize);
+            // Equivalent to TTree::SetBranchAddress() for a leaf branch, without looking up the branch by name
+            f1.leaf->GetBranch()->SetAddress((void *)f1.treeBuffer.get());
+            f1.address = f1.treeBuffer.get();
+        }
+        else
+        {
+            f1.address = static_cast<unsigned char *>(f1.leaf->GetValuePointer());
+        }
+    }
+    for (auto &c1 : fContainerFields)
+    {
+        if (bindBranches)
+        {
+            // The object is created by the converter rather than by the branch, so that it stays valid
+            // for the REntry as long as the branch is connected, and its capacity is reused across entries.
+            c1.kClass = TClass::GetClass(c1.typeName.c_str());
+            c1.treeObject = AcquireObject(c1.kClass);
+            c1.treeBuffer = std::make_shared<void *>(c1.treeObject.get());
+            c1.tree->SetBranchAddress(c1.treeName.c_str(), c1.treeBuffer.get(), c1.kClass, EDataType::kOther_t, true);
+            c1.address = c1.treeObject.get();
+        }
+        else
+        {
+            auto element = dynamic_cast<TBranchElement *>(c1.branch);
+            c1.address = element ? element->GetObject() : *reinterpret_cast<void **>(c1.branch->GetAddress());
+        }
+
+        std::string fieldType = c1.typeName;
+        auto kind = GetStringKind(c1.typeName);
+        if (fStringDictEncoding && bindBranches && kind != kNoString && IsLowCardinality(c1, kind, nEntries))
+        {
+            c1.stringDictionary = std::make_unique<StringDictionary>();
+            c1.stringDictionary->kind = kind;
+            fieldType = kind == kString ? "std::uint32_t" : "std::vector<std::uint32_t>";
+        }
+        auto field = RFieldBase::Create(c1.ntupleName, fieldType).Unwrap();
+        R__ASSERT(field);
+        if (fVerbosity >= 2)
+            std::cout << "Add field: " << field->GetName() << "; field type name: " << field->GetType()
+                      << (c1.stringDictionary ? " (dictionary-encoded)" : "") << std::endl;
+        model->AddField(std::move(field));
+    }
+    if (!fOriginalIndexField.empty())
+    {
+        model->AddField(RFieldBase::Create(fOriginalIndexField, "std::uint64_t").Unwrap());
+    }
+    model->Freeze();
+    return model;
+}
+
+void TTreeToRNTuple::OpenPiece(const RNTupleModel &model, const std::string &ntupleName, Long64_t firstEntry,
+                               std::unique_ptr<RNTupleWriter> &writer, std::unique_ptr<REntry> &entry)
+{
+    auto pieceModel = model.Clone();
+    if (!pieceModel->IsFrozen())
+    {
+        pieceModel->Freeze();
+    }
+    entry = BindEntry(*pieceModel);
+    // Append the RNTuple to the shared output file
+    writer = RNTupleWriter::Append(std::move(pieceModel), ntupleName, *fOutput, fWriteOptions);
+    fOutputPieces.push_back({ntupleName, fOutput->GetName(), firstEntry, 0});
+}
+
+void TTreeToRNTuple::ClosePiece(const std::string &ntupleName, std::unique_ptr<RNTupleWriter> &writer, std::unique_ptr<REntry> &entry)
+{
+    entry.reset();
+    writer.reset(); // commits the last cluster of the piece
+    WriteStringDictionaries(ntupleName);
+}
+
+void TTreeToRNTuple::PrepareEntry()
+{
+    for (auto &f1 : fFlatFields)
+    {
+        if (f1.isVariableSizedArray)
+        {
+            Int_t arrayLengthCurrentEntry = f1.leaf->GetLen();
+            f1.ntupleBuffer.assign(f1.address, f1.address + arrayLengthCurrentEntry * f1.leafTypeSize);
+        }
+    }
+    for (auto &c1 : fContainerFields)
+    {
+        if (c1.stringDictionary)
+        {
+            EncodeStrings(c1);
+        }
+    }
+}
+
+void TTreeToRNTuple::ConvertTree(TFile &inputFile, const std::string &treeName)
+{
+    auto tree = inputFile.Get<TTree>(treeName.c_str());
+    if (!tree)
+    {
+        throw RException(R__FAIL("Tree \'" + treeName + "\' is not found!\n"));
+    }
+
+    Long_t nEntries = tree->GetEntries();
+    if (fVerbosity >= 1)
+        printf("Number of entries in tree \'%s\': %ld.\n", treeName.c_str(), nEntries);
+
+    // Friend trees are attached to the main tree so that TTree::GetEntry() reads them in lockstep,
+    // each of them through its own TTreeCache. Their branches are prefixed by the friend alias.
+    std::vector<std::unique_ptr<TFile>> friendFiles;
+    std::vector<std::pair<TTree *, std::string>> trees = {{tree, ""}};
+    for (const auto &fr : fFriendTrees)
+    {
+        if (fr.mainTreeName != treeName)
+        {
+            continue;
+        }
+        TFile *friendFile = &inputFile;
+        if (!fr.fileName.empty() && fr.fileName != fInputFile)
+        {
+            friendFiles.emplace_back(TFile::Open(fr.fileName.c_str()));
+            R__ASSERT(friendFiles.back() && !friendFiles.back()->IsZombie());
+            friendFile = friendFiles.back().get();
+        }
+        auto friendTree = friendFile->Get<TTree>(fr.treeName.c_str());
+        if (!friendTree)
+        {
+            throw RException(R__FAIL("Friend tree \'" + fr.treeName + "\' is not found!\n"));
+        }
+        if (friendTree->GetEntries() != nEntries)
+        {
+            throw RException(R__FAIL("Friend tree \'" + fr.treeName + "\' and tree \'" + treeName + "\' have different number of entries!\n"));
+        }
+        tree->AddFriend(friendTree, fr.alias.c_str());
+        trees.push_back({friendTree, fr.alias});
+    }
+
+    DescribeTrees(trees);
+    auto model = BuildModel(nEntries, kTRUE);
+    if (fVerbosity >= 1)
+        printf("Convert %zu branches of tree \'%s\' into RNTuple fields.\n", fFlatFields.size() + fContainerFields.size(), treeName.c_str());
+
+    for (auto &t : trees)
+    {
+        if (fCacheSize >= 0)
+        {
+            t.first->SetCacheSize(fCacheSize);
+        }
+    }
+
+    // Every output file gets its own writer; its entry captures the same buffers as the previous one
+    std::unique_ptr<RNTupleWriter> ntuple;
+    std::unique_ptr<REntry> entry;
+    OpenPiece(*model, treeName, 0, ntuple, entry);
+
+    //
+    // With a filter, the branches it depends on are read first for every entry, and all other
+    // branches only for the entries passing it. Without a filter, TTree::GetEntry() reads everything.
+    //
+    std::unique_ptr<TTreeFormula> formula;
+    std::vector<TBranch *> predicateBranches;
+    std::vector<void *> predicateValues;
+    std::vector<TBranch *> filterBranches;
+    std::vector<TBranch *> otherBranches;
+    Bool_t hasFilter = !fFilterExpression.empty() || fFilterFunc;
+    if (hasFilter)
+    {
+        std::set<TBranch *> scheduled;
+        auto schedule = [&scheduled](TBranch *branch, std::vector<TBranch *> &branches)
+        {
+            // The branch holding the length of a variable-sized array is read before the array
+            auto leaf = static_cast<TLeaf *>(branch->GetListOfLeaves()->First());
+            if (leaf && leaf->GetLeafCount() && scheduled.insert(leaf->GetLeafCount()->GetBranch()).second)
+            {
+                branches.push_back(leaf->GetLeafCount()->GetBranch());
+            }
+            if (scheduled.insert(branch).second)
+            {
+                branches.push_back(branch);
+            }
+        };
+
+        if (!fFilterExpression.empty())
+        {
+            formula = std::make_unique<TTreeFormula>("filter", fFilterExpression.c_str(), tree);
+            if (formula->GetNdim() == 0)
+            {
+                throw RException(R__FAIL("Filter expression \'" + fFilterExpression + "\' cannot be compiled for tree \'" + treeName + "\'!\n"));
+            }
+            formula->SetQuickLoad(kTRUE);
+            for (Int_t k = 0; k < formula->GetNcodes(); k++)
+            {
+                if (formula->GetLeaf(k))
+                {
+                    schedule(formula->GetLeaf(k)->GetBranch(), filterBranches);
+                }
+            }
+        }
+        for (auto &name : fFilterBranches)
+        {
+            auto branch = tree->GetBranch(name.c_str());
+            if (!branch)
+            {
+                throw RException(R__FAIL("Filter branch \'" + name + "\' is not found in tree \'" + treeName + "\'!\n"));
+            }
+            predicateBranches.push_back(branch);
+            schedule(branch, filterBranches);
+        }
+        predicateValues.resize(predicateBranches.size());
+
+        for (auto &f1 : fFlatFields)
+        {
+            schedule(f1.leaf->GetBranch(), otherBranches);
+        }
+        for (auto &c1 : fContainerFields)
+        {
+            schedule(c1.branch, otherBranches);
+        }
+    }
+
+    //
+    // With sort keys, the entries of each window are read in the order of the keys. The window is
+    // either a fixed number of entries or a cluster of the input tree; its decompressed baskets are
+    // kept in memory up to fReorderMemory bytes, so that the permuted reads do not unzip them again.
+    //
+    std::vector<TLeaf *> keyLeaves;
+    for (auto &name : fSortKeys)
+    {
+        auto branch = tree->GetBranch(name.c_str());
+        if (!branch)
+        {
+            throw RException(R__FAIL("Sort key branch \'" + name + "\' is not found in tree \'" + treeName + "\'!\n"));
+        }
+        auto leaf = static_cast<TLeaf *>(branch->GetListOfLeaves()->First());
+        if (typeid(*branch) != typeid(TBranch) || leaf->GetLeafCount() || leaf->GetLenStatic() != 1)
+        {
+            throw RException(R__FAIL("Sort key branch \'" + name + "\' is not a scalar of a basic type!\n"));
+        }
+        keyLeaves.push_back(leaf);
+    }
+
+    // Branches only used by the filter or as sort keys are read for every entry and are cached as well
+    std::vector<TBranch *> extraBranches = filterBranches;
+    for (auto leaf : keyLeaves)
+    {
+        extraBranches.push_back(leaf->GetBranch());
+    }
+    CacheBranches(trees, extraBranches);
+    std::vector<Long64_t> window;
+    std::vector<SortKey> keys;
+    Long64_t windowStart = 0;
+    Long64_t windowEnd = 0;
+    auto clusterIter = tree->GetClusterIterator(0);
+    if (!keyLeaves.empty())
+    {
+        for (auto &t : trees)
+        {
+            t.first->SetMaxVirtualSize(fReorderMemory);
+        }
+    }
+
+    // Loop the tree
+    decltype(nEntries) n = 0;
+    decltype(nEntries) nSelected = 0;
+    for (n = 0; n < nEntries; n++)
+    {
+        Long64_t i = n;
+        if (!keyLeaves.empty())
+        {
+            if (n == windowEnd)
+            {
+                windowStart = n;
+                if (fReorderWindow > 0)
+                {
+                    windowEnd = std::min(n + fReorderWindow, (Long64_t)nEntries);
+                }
+                else
+                {
+                    clusterIter();
+                    windowEnd = std::min(clusterIter.GetNextEntry(), (Long64_t)nEntries);
+                }
+                SortWindow(keyLeaves, windowStart, windowEnd, window, keys);
+            }
+            i = window[n - windowStart];
+        }
+        fOriginalIndex = i;
+
+        Bool_t pass = kTRUE;
+        if (hasFilter)
+        {
+            tree->LoadTree(i);
+            for (auto b : filterBranches)
+            {
+                b->GetEntry(i);
+            }
+            if (formula)
+            {
+                // Same selection semantics as TTree::CopyTree(): any instance of an array expression may pass
+                pass = kFALSE;
+                Int_t ndata = formula->GetNdata();
+                for (Int_t k = 0; k < ndata && !pass; k++)
+                {
+                    pass = formula->EvalInstance(k) != 0;
+                }
+            }
+            if (pass && fFilterFunc)
+            {
+                for (decltype(predicateBranches.size()) k = 0; k < predicateBranches.size(); k++)
+                {
+                    auto element = dynamic_cast<TBranchElement *>(predicateBranches[k]);
+                    predicateValues[k] = element ? element->GetObject() : static_cast<TLeaf *>(predicateBranches[k]->GetListOfLeaves()->First())->GetValuePointer();
+                }
+                pass = fFilterFunc(predicateValues);
+            }
+            if (pass)
+            {
+                for (auto b : otherBranches)
+                {
+                    b->GetEntry(i);
+                }
+            }
+        }
+        else
+        {
+            tree->GetEntry(i);
+        }
+
+        if (pass)
+        {
+            // Rolling over is deferred to the next selected entry so that no empty piece is created
+            if (RollOverPending())
+            {
+                ClosePiece(treeName, ntuple, entry);
+                OpenOutputFile();
+                OpenPiece(*model, treeName, nSelected, ntuple, entry);
+            }
+
+            PrepareEntry();
+
+            ntuple->Fill(*entry);
+            fOutputPieces.back().nEntries++;
+            nSelected++;
+        }
+        if (fCallbackFunc && n%1000==0 )
+        {
+            fCallbackFunc(n, nEntries);
+        }
+    }
+    ClosePiece(treeName, ntuple, entry);
+    if (hasFilter && fVerbosity >= 1)
+    {
+        printf("Number of entries passing the filter in tree \'%s\': %ld.\n", treeName.c_str(), nSelected);
+    }
+    if (fCallbackFunc)
+    {
+        fCallbackFunc(n, nEntries);
+    }
+    for (auto &t : trees)
+    {
+        t.first->ResetBranchAddresses();
+        t.first->SetBranchStatus("*", 1);
+    }
+    ReleaseObjects();
+    for (auto &t : trees)
+    {
+        if (t.first != tree)
+        {
+            tree->RemoveFriend(t.first);
+        }
+    }
+}
+
+void TTreeToRNTuple::Attach(TTree *tree)
+{
+    R__ASSERT(tree);
+    if (fStreamTree)
+    {
+        throw RException(R__FAIL("Tree \'" + fStreamTreeName + "\' is already attached!\n"));
+    }
+    if (!fFriendTrees.empty() || !fFilterExpression.empty() || fFilterFunc || !fSortKeys.empty() || fStringDictEncoding)
+    {
+        throw RException(R__FAIL("Friend trees, filters, reordering and string dictionaries are not supported when streaming!\n"));
+    }
+
+    // The fields capture the addresses the producer has set on the branches; nothing is read back from the tree
+    DescribeTrees({{tree, ""}});
+    fStreamModel = BuildModel(0, kFALSE);
+    if (fVerbosity >= 1)
+        printf("Stream %zu branches of tree \'%s\' into RNTuple fields.\n", fFlatFields.size() + fContainerFields.size(), tree->GetName());
+
+    fStreamTree = tree;
+    fStreamTreeName = tree->GetName();
+    fStreamEntries = 0;
+    fNumOutputFiles = 0;
+    fOutputPieces.clear();
+    OpenOutputFile();
+    OpenPiece(*fStreamModel, fStreamTreeName, 0, fStreamWriter, fStreamEntry);
+    fPieceStartTime = std::chrono::steady_clock::now();
+}
+
+void TTreeToRNTuple::Fill()
+{
+    if (!fStreamTree)
+    {
+        throw RException(R__FAIL("No tree is attached!\n"));
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    Bool_t intervalElapsed = fCommitInterval > 0 &&
+                             std::chrono::duration<Double_t>(now - fPieceStartTime).count() >= fCommitInterval;
+    if (intervalElapsed || RollOverPending())
+    {
+        Commit();
+    }
+
+    fOriginalIndex = fStreamEntries;
+    PrepareEntry();
+    fStreamWriter->Fill(*fStreamEntry);
+    fOutputPieces.back().nEntries++;
+    fStreamEntries++;
+}
+
+void TTreeToRNTuple::Commit()
+{
+    if (!fStreamTree)
+    {
+        throw RException(R__FAIL("No tree is attached!\n"));
+    }
+    if (!IsRollingOutput())
+    {
+        throw RException(R__FAIL("Committing needs split output, see SetCommitInterval(), SetMaxEntriesPerFile() and SetMaxBytesPerFile()!\n"));
+    }
+    if (fOutputPieces.back().nEntries == 0)
+    {
+        fPieceStartTime = std::chrono::steady_clock::now();
+        return;
+    }
+
+    // A closed piece is a complete RNTuple that readers can open while the producer keeps filling
+    ClosePiece(fStreamTreeName, fStreamWriter, fStreamEntry);
+    WriteManifest();
+    OpenOutputFile();
+    OpenPiece(*fStreamModel, fStreamTreeName, fStreamEntries, fStreamWriter, fStreamEntry);
+    fPieceStartTime = std::chrono::steady_clock::now();
+}
+
+void TTreeToRNTuple::Detach()
+{
+    if (!fStreamTree)
+    {
+        return;
+    }
+    ClosePiece(fStreamTreeName, fStreamWriter, fStreamEntry);
+    fOutput.reset();
+    // The piece opened by the last Commit() may have stayed empty
+    if (fOutputPieces.size() > 1 && fOutputPieces.back().nEntries == 0)
+    {
+        gSystem->Unlink(fOutputPieces.back().fileName.c_str());
+        fOutputPieces.pop_back();
+    }
+    if (IsRollingOutput())
+    {
+        WriteManifest();
+    }
+    fStreamModel.reset();
+    fStreamTree = nullptr;
+}
+
+void TTreeToRNTuple::GenerateConverterSource(std::string sourceFile)
+{
+    if (!fFriendTrees.empty() || !fFilterExpression.empty() || fFilterFunc || !fSortKeys.empty())
+    {
+        throw RException(R__FAIL("Friend trees, filters and reordering are not supported by the generated converter!\n"));
+    }
+    // The generated converter writes one RNTuple per tree with the plain fields only; refuse rather than drop a setting
+    if (fStringDictEncoding || !fOriginalIndexField.empty())
+    {
+        throw RException(R__FAIL("String dictionaries and original index fields are not supported by the generated converter!\n"));
+    }
+    if (fMaxEntriesPerFile > 0 || fMaxBytesPerFile > 0 || fCommitInterval > 0)
+    {
+        throw RException(R__FAIL("Splitting the output is not supported by the generated converter!\n"));
+    }
+
+    std::unique_ptr<TFile> file(TFile::Open(fInputFile.c_str()));
+
+    R__ASSERT(file && !file->IsZombie());
+
+    auto treeNames = fTreeNames.empty() ? FindTreeNames(*file) : fTreeNames;
+    if (treeNames.empty())
+    {
+        throw RException(R__FAIL("No tree is found in \'" + fInputFile + "\'!\n"));
+    }
+
+    std::ostringstream converters;
+    std::set<std::string> headers;
+    for (const auto &treeName : treeNames)
+    {
+        auto tree = file->Get<TTree>(treeName.c_str());
+        if (!tree)
+        {
+            throw RException(R__FAIL("Tree \'" + treeName + "\' is not found!\n"));
+        }
+        WriteTreeConverter(converters, tree, headers);
+    }
+    fFlatFields.clear();
+    fContainerFields.clear();
+
+    std::ofstream source(sourceFile);
+    if (!source)
+    {
+        throw RException(R__FAIL("Source file \'" + sourceFile + "\' cannot be created!\n"));
+    }
+    source << "// Generated by TTreeToRNTuple::GenerateConverterSource() from \'" << fInputFile << "\'.\n"
+           << "// The types of the fields are fixed at generation time: regenerate the converter when the branches change.\n"
+           << "#include <ROOT/RNTuple.hxx>\n"
+           << "#include <ROOT/RNTupleModel.hxx>\n"
+           << "#include <ROOT/RNTupleOptions.hxx>\n"
+           << "#include <ROOT/RVec.hxx>\n"
+           << "\n"
+           << "#include <TFile.h>\n"
+           << "#include <TLeaf.h>\n"
+           << "#include <TSystem.h>\n"
+           << "#include <TTree.h>\n"
+           << "\n"
+           << "#include <algorithm>\n"
+           << "#include <array>\n"
+           << "#include <chrono>\n"
+           << "#include <cstdint>\n"
+           << "#include <cstdio>\n"
+           << "#include <iostream>\n"
+           << "#include <memory>\n"
+           << "#include <string>\n"
+           << "#include <tuple>\n"
+           << "#include <utility>\n"
+           << "#include <vector>\n"
+           << "\n";
+    for (const auto &header : headers)
+    {
+        source << "#include \"" << header << "\"\n";
+    }
+    source << (headers.empty() ? "" : "\n")
+           << "using RNTupleModel = ROOT::Experimental::RNTupleModel;\n"
+           << "using RNTupleWriteOptions = ROOT::Experimental::RNTupleWriteOptions;\n"
+           << "using RNTupleWriter = ROOT::Experimental::RNTupleWriter;\n"
+           << "\n"
+           << "// Allocates the buffer of a variable-size array for the longest array of the input tree\n"
+           << "template <typename T>\n"
+           << "inline bool BindArray(TTree &tree, const char *branchName, std::unique_ptr<T[]> &buffer, Int_t &capacity)\n"
+           << "{\n"
+           << "    auto branch = tree.GetBranch(branchName);\n"
+           << "    auto leaf = branch ? static_cast<TLeaf *>(branch->GetListOfLeaves()->First()) : nullptr;\n"
+           << "    if (!leaf || !leaf->GetLeafCount())\n"
+           << "    {\n"
+           << "        std::cerr << \"Branch '\" << branchName << \"' is not a variable-size array!\" << std::endl;\n"
+           << "        return false;\n"
+           << "    }\n"
+           << "    capacity = std::max(leaf->GetLeafCount()->GetMaximum(), 1);\n"
+           << "    buffer = std::make_unique<T[]>(capacity);\n"
+           << "    return tree.SetBranchAddress(branchName, static_cast<void *>(buffer.get())) >= 0;\n"
+           << "}\n"
+           << "\n"
+           << "// Copies the filled part of a variable-size array\n"
+           << "template <typename T, typename C>\n"
+           << "inline bool CopyArray(const std::unique_ptr<T[]> &buffer, Int_t capacity, C length, std::vector<T> &field)\n"
+           << "{\n"
+           << "    if (length < 0 || length > capacity)\n"
+           << "        return false;\n"
+           << "    field.assign(buffer.get(), buffer.get() + length);\n"
+           << "    return true;\n"
+           << "}\n"
+           << "\n"
+           << "// Branches are bound once to the members of EntryT; the loop itself has no name lookups and no type dispatch\n"
+           << "template <typename EntryT>\n"
+           << "Long64_t ConvertTree(TFile &input, TFile &output, const char *treeName, const RNTupleWriteOptions &options)\n"
+           << "{\n"
+           << "    auto tree = input.Get<TTree>(treeName);\n"
+           << "    if (!tree)\n"
+           << "    {\n"
+           << "        std::cerr << \"Tree '\" << treeName << \"' is not found!\" << std::endl;\n"
+           << "        return -1;\n"
+           << "    }\n"
+           << "    auto model = RNTupleModel::Create();\n"
+           << "    auto entry = std::make_unique<EntryT>(*model);\n"
+           << "    if (!entry->Bind(*tree))\n"
+           << "    {\n"
+           << "        std::cerr << \"Tree '\" << treeName << \"' does not match the schema of the converter!\" << std::endl;\n"
+           << "        return -1;\n"
+           << "    }\n"
+           << "    auto writer = RNTupleWriter::Append(std::move(model), treeName, output, options);\n"
+           << "    Long64_t nEntries = tree->GetEntries();\n"
+           << "    for (Long64_t i = 0; i < nEntries; i++)\n"
+           << "    {\n"
+           << "        tree->GetEntry(i);\n"
+           << "        if (!entry->Prepare())\n"
+           << "        {\n"
+           << "            std::cerr << \"Array length out of range in entry \" << i << \" of tree '\" << treeName << \"'!\" << std::endl;\n"
+           << "            return -1;\n"
+           << "        }\n"
+           << "        writer->Fill();\n"
+           << "    }\n"
+           << "    writer.reset();\n"
+           << "    tree->ResetBranchAddresses();\n"
+           << "    return nEntries;\n"
+           << "}\n"
+           << converters.str()
+           << "\n"
+           << "// Returns the number of converted entries, or -1 on error\n"
+           << "Long64_t ConvertFile(const char *inputFile, const char *outputFile)\n"
+           << "{\n"
+           << "    std::unique_ptr<TFile> input(TFile::Open(inputFile));\n"
+           << "    std::unique_ptr<TFile> output(TFile::Open(outputFile, \"RECREATE\"));\n"
+           << "    if (!input || input->IsZombie() || !output || output->IsZombie())\n"
+           << "    {\n"
+           << "        std::cerr << \"Input or output file cannot be opened!\" << std::endl;\n"
+           << "        return -1;\n"
+           << "    }\n"
+           << "    RNTupleWriteOptions options;\n"
+           << "    options.SetCompression(" << fWriteOptions.GetCompression() << ");\n"
+           << "\n"
+           << "    auto start = std::chrono::steady_clock::now();\n"
+           << "    Long64_t nEntries = 0;\n";
+    for (const auto &treeName : treeNames)
+    {
+        source << "    Long64_t n" << GetIdentifier(treeName) << " = ConvertTree<" << GetIdentifier(treeName) << "Entry>(*input, *output, \"" << treeName << "\", options);\n"
+               << "    if (n" << GetIdentifier(treeName) << " < 0)\n"
+               << "        return -1;\n"
+               << "    nEntries += n" << GetIdentifier(treeName) << ";\n";
+    }
+    source << "    output.reset();\n"
+           << "    Double_t seconds = std::chrono::duration<Double_t>(std::chrono::steady_clock::now() - start).count();\n"
+           << "    printf(\"Converted %lld entries in %.2f s (%.0f entries/s).\\n\", nEntries, seconds, nEntries / seconds);\n"
+           << "    return nEntries;\n"
+           << "}\n"
+           << "\n"
+           << "// Defined when the source is compiled into another program, e.g. by the interpreter\n"
+           << "#ifndef TTREETORNTUPLE_CONVERTER_NO_MAIN\n"
+           << "int main(int argc, char **argv)\n"
+           << "{\n"
+           << "    if (argc != 3)\n"
+           << "    {\n"
+           << "        std::cout << \"Usage: \" << argv[0] << \" <input.root> <output.ntuple>\" << std::endl;\n"
+           << "        return 1;\n"
+           << "    }\n";
+    for (const auto &d : fDictionary)
+    {
+        source << "    gSystem->Load(\"" << d << "\");\n";
+    }
+    source << "    return ConvertFile(argv[1], argv[2]) < 0 ? 1 : 0;\n"
+           << "}\n"
+           << "#endif\n";
+
+    if (fVerbosity >= 1)
+        printf("Converter source for %zu trees is written to \'%s\'.\n", treeNames.size(), sourceFile.c_str());
+}
+
+std::string TTreeToRNTuple::GetIdentifier(const std::string &name)
+{
+    std::string identifier = name;
+    for (auto &c : identifier)
+    {
+        if (!isalnum(static_cast<unsigned char>(c)))
+        {
+            c = '_';
+        }
+    }
+    return identifier;
+}
+
+void TTreeToRNTuple::WriteTreeConverter(std::ostream &source, TTree *tree, std::set<std::string> &headers)
+{
+    // One struct per tree: the RNTuple fields are members of static type, and the branches are bound to them
+    // directly, so that TTree::GetEntry() writes into the storage that RNTupleWriter::Fill() reads.
+    DescribeTrees({{tree, ""}});
+
+    std::string entryName = GetIdentifier(tree->GetName()) + "Entry";
+    std::ostringstream members, constructor, bind, prepare;
+    std::set<std::string> identifiers;
+    auto addMember = [&identifiers, this](const std::string &name)
+    {
+        std::string identifier = "f" + GetIdentifier(name);
+        while (!identifiers.insert(identifier).second)
+        {
+            identifier += "_";
+        }
+        return identifier;
+    };
+
+    std::map<TLeaf *, std::string> values;
+    std::vector<std::pair<TLeaf *, std::string>> arrays;
+    for (auto &f1 : fFlatFields)
+    {
+        auto fieldType = RFieldBase::Create(f1.ntupleName, GetFieldType(f1)).Unwrap()->GetType();
+        auto member = addMember(f1.ntupleName);
+        members << "    std::shared_ptr<" << fieldType << "> " << member << ";\n";
+        constructor << (constructor.tellp() > 0 ? ",\n          " : "") << member << "(model.MakeField<" << fieldType << ">(\"" << f1.ntupleName << "\"))";
+        std::string branchName = f1.leaf->GetBranch()->GetName();
+        if (f1.isVariableSizedArray)
+        {
+            // Sized in Bind() from the input tree, since later files may hold longer arrays than this one
+            members << "    std::unique_ptr<" << f1.typeName << "[]> " << member << "Buffer;\n"
+                    << "    Int_t " << member << "Capacity;\n";
+            arrays.push_back({f1.leaf, member});
+            bind << "        if (!BindArray(tree, \"" << branchName << "\", " << member << "Buffer, " << member << "Capacity))\n"
+                 << "            return false;\n";
+        }
+        else if (f1.arrayLength > 1)
+        {
+            bind << "        if (tree.SetBranchAddress(\"" << branchName << "\", static_cast<void *>(" << member << "->data())) < 0)\n"
+                 << "            return false;\n";
+        }
+        else
+        {
+            bind << "        if (tree.SetBranchAddress(\"" << branchName << "\", static_cast<void *>(" << member << ".get())) < 0)\n"
+                 << "            return false;\n";
+            values[f1.leaf] = "*" + member;
+        }
+    }
+    for (auto &[leaf, member] : arrays)
+    {
+        // The length is read from the count branch, which gets its own member if it is not converted
+        auto countLeaf = leaf->GetLeafCount();
+        if (values.find(countLeaf) == values.end())
+        {
+            auto countMember = addMember(std::string(countLeaf->GetName()) + "Count");
+            members << "    " << countLeaf->GetTypeName() << " " << countMember << ";\n";
+            bind << "        if (tree.SetBranchAddress(\"" << countLeaf->GetBranch()->GetName() << "\", static_cast<void *>(&" << countMember << ")) < 0)\n"
+                 << "            return false;\n";
+            values[countLeaf] = countMember;
+        }
+        prepare << "        if (!CopyArray(" << member << "Buffer, " << member << "Capacity, " << values[countLeaf] << ", *" << member << "))\n"
+                << "            return false;\n";
+    }
+    for (auto &c1 : fContainerFields)
+    {
+        auto fieldType = RFieldBase::Create(c1.ntupleName, c1.typeName).Unwrap()->GetType();
+        auto member = addMember(c1.ntupleName);
+        members << "    std::shared_ptr<" << fieldType << "> " << member << ";\n"
+                << "    " << fieldType << " *" << member << "Address;\n";
+        constructor << (constructor.tellp() > 0 ? ",\n          " : "") << member << "(model.MakeField<" << fieldType << ">(\"" << c1.ntupleName << "\"))";
+        bind << "        " << member << "Address = " << member << ".get();\n"
+             << "        if (tree.SetBranchAddress(\"" << c1.branch->GetName() << "\", &" << member << "Address) < 0)\n"
+             << "            return false;\n";
+        // User-defined classes need their declaration; the headers are looked up in the include path
+        auto kClass = TClass::GetClass(c1.typeName.c_str());
+        if (kClass && !kClass->GetCollectionProxy() && fieldType.rfind("std::", 0) != 0 && fieldType.rfind("ROOT::", 0) != 0 &&
+            kClass->GetDeclFileName() && strlen(kClass->GetDeclFileName()) > 0)
+        {
+            headers.insert(gSystem->BaseName(kClass->GetDeclFileName()));
+        }
+    }
+    if (fVerbosity >= 1)
+        printf("Generate struct \'%s\' with %zu fields for tree \'%s\'.\n", entryName.c_str(), fFlatFields.size() + fContainerFields.size(), tree->GetName());
+
+    source << "\n"
+           << "struct " << entryName << "\n"
+           << "{\n"
+           << members.str()
+           << "\n"
+           << "    explicit " << entryName << "(RNTupleModel &model)\n"
+           << (constructor.tellp() > 0 ? "        : " + constructor.str() + "\n" : "")
+           << "    {\n"
+           << "    }\n"
+           << "\n"
+           << "    bool Bind(TTree &tree)\n"
+           << "    {\n"
+           << bind.str()
+           << "        return true;\n"
+           << "    }\n"
+           << "\n"
+           << "    bool Prepare()\n"
+           << "    {\n"
+           << prepare.str()
+           << "        return true;\n"
+           << "    }\n"
+           << "};\n";
+}
@@ -4,6 +4,9 @@
 
 #include <string>
 #include <vector>
+#include <chrono>
+#include <fstream>
+#include <sstream>
 #include <algorithm>
 #include <cmath>
 #include <stdio.h>
@@ -21,6 +24,7 @@
 using RNTupleReader = ROOT::Experimental::RNTupleReader;
 using ENTupleShowFormat = ROOT::Experimental::ENTupleShowFormat;
 using ENTupleInfo = ROOT::Experimental::ENTupleInfo;
+using RException = ROOT::Experimental::RException;
 
 #define nEntries 10000
 
@@ -39,8 +43,8 @@ TEST(UnitTest, CreateTTree)
     std::array<float, 10> array_float;
     std::vector<Float_t> vec_float;
     std::vector<bool> vec_bool;
-    // ROOT::RVec<double> RVec_double;
-    // ROOT::RVec<std::string> RVec_string;
+    ROOT::RVec<double> RVec_double;
+    ROOT::RVec<std::string> RVec_string;
     std::pair<int, float> pair_;
     std::tuple<std::string, int, float> tuple_;
     std::string string_;
@@ -54,8 +58,8 @@ TEST(UnitTest, CreateTTree)
     tree->Branch("array_float", &array_float);
     tree->Branch("vec_float", "std::vector<Float_t>", &vec_float);
     tree->Branch("vec_bool", &vec_bool);
-    // tree->Branch("RVec_double",&RVec_double);
-    // tree->Branch("RVec_string",&RVec_string);
+    tree->Branch("RVec_double", &RVec_double);
+    tree->Branch("RVec_string", &RVec_string);
     tree->Branch("pair_", &pair_);
     tree->Branch("tuple_", &tuple_);
     tree->Branch("string_", "std::string", &string_);
@@ -100,16 +104,16 @@ TEST(UnitTest, CreateTTree)
 
         vec_float.clear();
         vec_bool.clear();
-        // RVec_double.clear();
-        // RVec_string.clear();
+        RVec_double.clear();
+        RVec_string.clear();
         for (int j = 0; j < nX; j++)
             vec_float.push_back((float)(j * i));
         for (int k = 0; k < 20; k++)
             vec_bool.push_back((k * i) % 2 == 0 ? true : false);
-        // for (int k = 0; k < nX; k++)
-        //     RVec_double.push_back((double)(k * i));
-        // for (int k = 0; k < 5; k++)
-        //     RVec_string.push_back(std::to_string(k));
+        for (int k = 0; k < nX; k++)
+            RVec_double.push_back((double)(k * i));
+        for (int k = 0; k < 5; k++)
+            RVec_string.push_back(std::to_string(k));
         pair_ = std::make_pair(i, (float)i + 1.);
         tuple_ = std::make_tuple(std::to_string(i), i, (float)(i + 100.));
         string_ = std::to_string(i);
@@ -165,8 +169,8 @@ TEST(UnitTest, Comparison)
     auto fldAarray_float = model->MakeField<std::array<float, 10>>("array_float");
     auto fldVec_float = model->MakeField<std::vector<float>>("vec_float");
     auto fldVec_bool = model->MakeField<std::vector<bool>>("vec_bool");
-    // auto fldRVec_double = model->MakeField<ROOT::RVec<double>>("RVec_double");
-    // auto fldRVec_string = model->MakeField<ROOT::RVec<std::string>>("RVec_string");
+    auto fldRVec_double = model->MakeField<ROOT::RVec<double>>("RVec_double");
+    auto fldRVec_string = model->MakeField<ROOT::RVec<std::string>>("RVec_string");
     auto fldPair = model->MakeField<std::pair<int, float>>("pair_");
     auto fldTuple = model->MakeField<std::tuple<std::string, int, float>>("tuple_");
     auto fldString = model->MakeField<std::string>("string_");
@@ -243,21 +247,20 @@ TEST(UnitTest, Comparison)
             Bool_t tempBool = (entryId * i) % 2 == 0 ? true : false;
             EXPECT_EQ(tempBool, fldVec_bool->at(i)) << "Branch 'vec_bool' and field 'vec_bool' differ at entry " << entryId << " at index" << i;
         }
-        /*
-            //ROOT::RVec<double>* RVec_double
-            EXPECT_EQ(nX, fldRVec_double->size())<<"[RVec length] Branch 'RVec_double' and field 'RVec_double' differ at entry "<< entryId;
-            for(decltype(fldRVec_double->size()) i = 0; i < fldRVec_double->size(); i++)
-            {
-                EXPECT_DOUBLE_EQ((double)(entryId*i), fldRVec_double->at(i))<< "Branch 'RVec_double' and field 'RVec_double' differ at entry "<<entryId<<" at index" << i;
-            }
+        // ROOT::RVec<double>* RVec_double
+        EXPECT_EQ(nX, fldRVec_double->size()) << "[RVec length] Branch 'RVec_double' and field 'RVec_double' differ at entry " << entryId;
+        for (decltype(fldRVec_double->size()) i = 0; i < fldRVec_double->size(); i++)
+        {
+            EXPECT_DOUBLE_EQ((double)(entryId * i), fldRVec_double->at(i)) << "Branch 'RVec_double' and field 'RVec_double' differ at entry " << entryId << " at index" << i;
+        }
+
+        // ROOT::RVec<std::string>* RVec_string
+        EXPECT_EQ(5, fldRVec_string->size()) << "[RVec length] Branch 'RVec_string' and field 'RVec_string' differ at entry " << entryId;
+        for (decltype(fldRVec_string->size()) i = 0; i < fldRVec_string->size(); i++)
+        {
+            EXPECT_STREQ(std::to_string(i).c_str(), fldRVec_string->at(i).c_str()) << "Branch 'RVec_string' and field 'RVec_string' differ at entry " << entryId << " at index" << i;
+        }
 
-            //ROOT::RVec<std::string>* RVec_string
-            EXPECT_EQ(5, fldRVec_string->size())<<"[RVec length] Branch 'RVec_string' and field 'RVec_string' differ at entry "<< entryId;
-            for(decltype(fldRVec_string->size()) i = 0; i < fldRVec_string->size(); i++)
-            {
-                EXPECT_STREQ(std::to_string(i).c_str(), fldRVec_string->at(i).c_str())<< "Branch 'RVec_string' and field 'RVec_string' differ at entry "<<entryId<<" at index" << i;
-            }
-        */
         // std::pair<int, float>* pair_
         EXPECT_EQ(entryId, fldPair->first) << "Branch 'pair_' and field 'pair_' differ at entry " << entryId;
         EXPECT_FLOAT_EQ((float)(entryId + 1.), fldPair->second) << "Branch 'pair_' and field 'pair_' differ at entry " << entryId;
@@ -272,3 +275,457 @@ TEST(UnitTest, Comparison)
     }
     std::cout << "Comparison completed!" << std::endl;
 }
+
+TEST(UnitTest, MultiTreeConversion)
+{
+    {
+        auto rootFile = std::make_shared<TFile>("/tmp/TestMultiTree.root", "RECREATE");
+        auto events = std::make_shared<TTree>("Events", "Tree with one entry per event");
+        auto runs = std::make_shared<TTree>("Runs", "Tree with one entry per run");
+        auto calib = std::make_shared<TTree>("Calib", "Friend tree of Events");
+        Int_t event, run;
+        Float_t energy;
+        events->Branch("event", &event, "event/I");
+        runs->Branch("run", &run, "run/I");
+        calib->Branch("energy", &energy, "energy/F");
+        for (int i = 0; i < nEntries; i++)
+        {
+            event = i;
+            energy = (float)i / 2;
+            events->Fill();
+            calib->Fill();
+        }
+        for (int i = 0; i < 10; i++)
+        {
+            run = i;
+            runs->Fill();
+        }
+        rootFile->Write();
+        rootFile->Close();
+    }
+
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestMultiTree.root", "/tmp/TestMultiTree.ntuple", "");
+    EXPECT_NO_THROW(conversion->SelectAllTrees());
+    EXPECT_NO_THROW(conversion->Convert());
+
+    auto events = RNTupleReader::Open("Events", "/tmp/TestMultiTree.ntuple");
+    auto runs = RNTupleReader::Open("Runs", "/tmp/TestMultiTree.ntuple");
+    EXPECT_EQ(nEntries, events->GetNEntries()) << "[Number of entries] Tree 'Events' and RNTuple 'Events' have different number of entries";
+    EXPECT_EQ(10, runs->GetNEntries()) << "[Number of entries] Tree 'Runs' and RNTuple 'Runs' have different number of entries";
+    auto viewRun = runs->GetView<int>("run");
+    for (auto entryId : *runs)
+    {
+        EXPECT_EQ(entryId, viewRun(entryId)) << "Branch 'run' and field 'run' differ at entry " << entryId;
+    }
+
+    // A friend joins only its main tree, and is not converted on its own
+    EXPECT_NO_THROW(conversion->SetOutputFile("/tmp/TestMultiTreeFriend.ntuple"));
+    EXPECT_NO_THROW(conversion->AddFriendTree("Events", "Calib"));
+    EXPECT_NO_THROW(conversion->Convert());
+    auto eventsWithFriend = RNTupleReader::Open("Events", "/tmp/TestMultiTreeFriend.ntuple");
+    auto runsWithoutFriend = RNTupleReader::Open("Runs", "/tmp/TestMultiTreeFriend.ntuple");
+    EXPECT_NE(ROOT::Experimental::kInvalidDescriptorId, eventsWithFriend->GetDescriptor()->FindFieldId("Calib__energy")) << "Friend tree 'Calib' is not joined to tree 'Events'";
+    EXPECT_EQ(ROOT::Experimental::kInvalidDescriptorId, runsWithoutFriend->GetDescriptor()->FindFieldId("Calib__energy")) << "Friend tree 'Calib' is joined to tree 'Runs'";
+    std::unique_ptr<TFile> ntupleFile(TFile::Open("/tmp/TestMultiTreeFriend.ntuple"));
+    EXPECT_EQ(nullptr, ntupleFile->GetKey("Calib")) << "Friend tree 'Calib' is converted on its own";
+}
+
+TEST(UnitTest, FriendTreeConversion)
+{
+    {
+        auto rootFile = std::make_shared<TFile>("/tmp/TestFriendTree.root", "RECREATE");
+        auto calib = std::make_shared<TTree>("Calib", "Friend tree of MixedTree");
+        Float_t nZ;
+        calib->Branch("nZ", &nZ, "nZ/F");
+        for (int i = 0; i < nEntries; i++)
+        {
+            nZ = (float)i / 2;
+            calib->Fill();
+        }
+        rootFile->Write();
+        rootFile->Close();
+    }
+
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestFile.root", "/tmp/TestFriendTree.ntuple", "MixedTree");
+    EXPECT_NO_THROW(conversion->SetDictionary({"../../test/SimpleClass_cxx"}));
+    EXPECT_NO_THROW(conversion->AddFriendTree("MixedTree", "Calib", "/tmp/TestFriendTree.root"));
+    EXPECT_NO_THROW(conversion->SelectBranches({"nZ", "Calib.nZ"}));
+    EXPECT_NO_THROW(conversion->Convert());
+
+    auto ntuple = RNTupleReader::Open("MixedTree", "/tmp/TestFriendTree.ntuple");
+    EXPECT_EQ(nEntries, ntuple->GetNEntries()) << "[Number of entries] TTree and RNTuple have different number of entries";
+    auto viewNZ = ntuple->GetView<int>("nZ");
+    auto viewCalibNZ = ntuple->GetView<float>("Calib__nZ");
+    for (auto entryId : *ntuple)
+    {
+        EXPECT_EQ((Int_t)(std::log10(entryId + 1) * 10 + 2), viewNZ(entryId)) << "Branch 'nZ' and field 'nZ' differ at entry " << entryId;
+        EXPECT_FLOAT_EQ((float)entryId / 2, viewCalibNZ(entryId)) << "Branch 'Calib.nZ' and field 'Calib__nZ' differ at entry " << entryId;
+    }
+
+    // A regular expression matches the dotted branch name of a friend as well
+    std::unique_ptr<TTreeToRNTuple> regexConversion = std::make_unique<TTreeToRNTuple>("/tmp/TestFile.root", "/tmp/TestFriendTreeRegex.ntuple", "MixedTree");
+    EXPECT_NO_THROW(regexConversion->AddFriendTree("MixedTree", "Calib", "/tmp/TestFriendTree.root"));
+    EXPECT_NO_THROW(regexConversion->SelectBranches({"/^Calib\\.nZ$/"}));
+    EXPECT_NO_THROW(regexConversion->Convert());
+    auto regexNtuple = RNTupleReader::Open("MixedTree", "/tmp/TestFriendTreeRegex.ntuple");
+    EXPECT_NE(ROOT::Experimental::kInvalidDescriptorId, regexNtuple->GetDescriptor()->FindFieldId("Calib__nZ")) << "Branch 'Calib.nZ' is not selected by its regular expression";
+}
+
+TEST(UnitTest, WideTreeConversion)
+{
+    const int nBranches = 10000;
+    {
+        auto rootFile = std::make_shared<TFile>("/tmp/TestWideTree.root", "RECREATE");
+        auto tree = std::make_shared<TTree>("Wide", "Tree with many branches");
+        std::vector<Float_t> values(nBranches);
+        for (int k = 0; k < nBranches; k++)
+        {
+            std::string name = "b" + std::to_string(k);
+            tree->Branch(name.c_str(), &values[k], (name + "/F").c_str(), 1000);
+        }
+        for (int i = 0; i < 100; i++)
+        {
+            for (int k = 0; k < nBranches; k++)
+                values[k] = i + k;
+            tree->Fill();
+        }
+        rootFile->Write();
+        rootFile->Close();
+    }
+
+    // 'b1*' selects 1111 of the 10000 branches; the set-up must not grow quadratically with the branches
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestWideTree.root", "/tmp/TestWideTree.ntuple", "Wide");
+    EXPECT_NO_THROW(conversion->SelectBranches({"b1*"}));
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_NO_THROW(conversion->Convert());
+    Double_t seconds = std::chrono::duration<Double_t>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Converted 1111 of " << nBranches << " branches in " << seconds << " s." << std::endl;
+    EXPECT_LT(seconds, 60) << "Converting a selection of a wide tree is too slow";
+
+    auto ntuple = RNTupleReader::Open("Wide", "/tmp/TestWideTree.ntuple");
+    int nFields = 0;
+    for (auto &field : ntuple->GetDescriptor()->GetTopLevelFields())
+    {
+        (void)field;
+        nFields++;
+    }
+    EXPECT_EQ(1111, nFields) << "[Number of fields] Glob 'b1*' selects a wrong number of branches";
+    auto viewB1 = ntuple->GetView<float>("b1");
+    for (auto entryId : *ntuple)
+    {
+        EXPECT_FLOAT_EQ(entryId + 1, viewB1(entryId)) << "Branch 'b1' and field 'b1' differ at entry " << entryId;
+    }
+}
+
+TEST(UnitTest, FilteredConversion)
+{
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestFile.root", "/tmp/TestFiltered.ntuple", "MixedTree");
+    EXPECT_NO_THROW(conversion->SetDictionary({"../../test/SimpleClass_cxx"}));
+    EXPECT_NO_THROW(conversion->SelectBranches({"nZ", "z", "string_"}));
+    EXPECT_NO_THROW(conversion->SetFilter("nZ > 40"));
+    EXPECT_NO_THROW(conversion->SetFilter({"pair_"}, [](const std::vector<void *> &values)
+                                          { return static_cast<std::pair<int, float> *>(values[0])->first % 2 == 0; }));
+    EXPECT_NO_THROW(conversion->Convert());
+
+    std::vector<Int_t> selected;
+    for (int i = 0; i < nEntries; i++)
+    {
+        if ((Int_t)(std::log10(i + 1) * 10 + 2) > 40 && i % 2 == 0)
+            selected.push_back(i);
+    }
+
+    auto ntuple = RNTupleReader::Open("MixedTree", "/tmp/TestFiltered.ntuple");
+    EXPECT_EQ(selected.size(), ntuple->GetNEntries()) << "[Number of entries] RNTuple does not contain exactly the entries passing the filter";
+    auto viewNZ = ntuple->GetView<int>("nZ");
+    auto viewZ = ntuple->GetView<std::vector<double>>("z");
+    auto viewString = ntuple->GetView<std::string>("string_");
+    for (auto entryId : *ntuple)
+    {
+        if (entryId >= selected.size())
+            break;
+        Int_t treeEntryId = selected[entryId];
+        EXPECT_EQ((Int_t)(std::log10(treeEntryId + 1) * 10 + 2), viewNZ(entryId)) << "Branch 'nZ' and field 'nZ' differ at entry " << treeEntryId;
+        EXPECT_EQ(viewNZ(entryId), viewZ(entryId).size()) << "[Vector length] Branch 'z' and field 'z' differ at entry " << treeEntryId;
+        EXPECT_STREQ(std::to_string(treeEntryId).c_str(), viewString(entryId).c_str()) << "Branch 'string_' and field 'string_' differ at entry " << treeEntryId;
+    }
+}
+
+TEST(UnitTest, RollingOutputConversion)
+{
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestFile.root", "/tmp/TestRolling.ntuple", "MixedTree");
+    EXPECT_NO_THROW(conversion->SetDictionary({"../../test/SimpleClass_cxx"}));
+    EXPECT_NO_THROW(conversion->SelectBranches({"nZ"}));
+    EXPECT_NO_THROW(conversion->SetMaxEntriesPerFile(3000));
+    EXPECT_NO_THROW(conversion->Convert());
+
+    auto pieces = conversion->GetOutputPieces();
+    EXPECT_EQ(4, pieces.size()) << "[Number of pieces] Output is not split every 3000 entries";
+    EXPECT_STREQ("/tmp/TestRolling.manifest.json", conversion->GetManifestFile().c_str());
+    EXPECT_EQ(0, gSystem->AccessPathName(conversion->GetManifestFile().c_str())) << "Manifest file is not written";
+    Long64_t nextEntry = 0;
+    for (auto &piece : pieces)
+    {
+        EXPECT_EQ(nextEntry, piece.firstEntry) << "Piece '" << piece.fileName << "' does not continue the previous piece";
+        auto ntuple = RNTupleReader::Open("MixedTree", piece.fileName);
+        EXPECT_EQ(piece.nEntries, ntuple->GetNEntries()) << "Piece '" << piece.fileName << "' and manifest have different number of entries";
+        auto viewNZ = ntuple->GetView<int>("nZ");
+        for (auto entryId : *ntuple)
+        {
+            Long64_t treeEntryId = piece.firstEntry + entryId;
+            EXPECT_EQ((Int_t)(std::log10(treeEntryId + 1) * 10 + 2), viewNZ(entryId)) << "Branch 'nZ' and field 'nZ' differ at entry " << treeEntryId;
+        }
+        nextEntry += piece.nEntries;
+    }
+    EXPECT_EQ(nEntries, nextEntry) << "[Number of entries] TTree and output pieces have different number of entries";
+}
+
+TEST(UnitTest, BranchPatternConversion)
+{
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestFile.root", "/tmp/TestBranchPattern.ntuple", "MixedTree");
+    EXPECT_NO_THROW(conversion->SetVerbosity(0));
+    EXPECT_NO_THROW(conversion->SetDictionary({"../../test/SimpleClass_cxx"}));
+    EXPECT_THROW(conversion->SelectBranches({"/[x/"}), RException);
+    EXPECT_NO_THROW(conversion->SelectBranches({"vec_*", "/^[xy]$/"}));
+    EXPECT_NO_THROW(conversion->ExcludeBranches({"*_bool"}));
+    EXPECT_NO_THROW(conversion->Convert());
+
+    auto ntuple = RNTupleReader::Open("MixedTree", "/tmp/TestBranchPattern.ntuple");
+    auto descriptor = ntuple->GetDescriptor();
+    for (std::string name : {"vec_float", "x", "y"})
+    {
+        EXPECT_NE(ROOT::Experimental::kInvalidDescriptorId, descriptor->FindFieldId(name)) << "Selected branch '" << name << "' is not converted";
+    }
+    for (std::string name : {"vec_bool", "nZ", "z", "simpleClass"})
+    {
+        EXPECT_EQ(ROOT::Experimental::kInvalidDescriptorId, descriptor->FindFieldId(name)) << "Branch '" << name << "' is converted although it is not selected";
+    }
+}
+
+TEST(UnitTest, ReorderedConversion)
+{
+    {
+        auto rootFile = std::make_shared<TFile>("/tmp/TestReorder.root", "RECREATE");
+        auto tree = std::make_shared<TTree>("Events", "Tree in acquisition order");
+        Int_t run, value;
+        tree->Branch("run", &run, "run/I");
+        tree->Branch("value", &value, "value/I");
+        for (int i = 0; i < nEntries; i++)
+        {
+            run = i % 3;
+            value = i;
+            tree->Fill();
+        }
+        rootFile->Write();
+        rootFile->Close();
+    }
+
+    Long64_t window = 100;
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestReorder.root", "/tmp/TestReorder.ntuple", "Events");
+    EXPECT_NO_THROW(conversion->SetReorder({"run"}, window));
+    EXPECT_NO_THROW(conversion->SetOriginalIndexField("_entry"));
+    EXPECT_NO_THROW(conversion->Convert());
+
+    auto ntuple = RNTupleReader::Open("Events", "/tmp/TestReorder.ntuple");
+    EXPECT_EQ(nEntries, ntuple->GetNEntries()) << "[Number of entries] TTree and RNTuple have different number of entries";
+    auto viewRun = ntuple->GetView<int>("run");
+    auto viewValue = ntuple->GetView<int>("value");
+    auto viewEntry = ntuple->GetView<std::uint64_t>("_entry");
+    for (auto entryId : *ntuple)
+    {
+        EXPECT_EQ(viewValue(entryId), viewEntry(entryId)) << "Field '_entry' does not point to the original entry at entry " << entryId;
+        EXPECT_EQ(viewValue(entryId) % 3, viewRun(entryId)) << "Branch 'run' and field 'run' differ at entry " << entryId;
+        EXPECT_EQ(entryId / window, viewEntry(entryId) / window) << "Entry " << entryId << " is moved out of its window";
+        if (entryId % window != 0)
+        {
+            EXPECT_LE(viewRun(entryId - 1), viewRun(entryId)) << "Entries are not sorted by 'run' at entry " << entryId;
+        }
+    }
+
+    auto fieldSizes = TTreeToRNTuple::GetFieldSizes("/tmp/TestReorder.ntuple", "Events");
+    EXPECT_EQ(3, fieldSizes.size()) << "[Number of fields] Field sizes are not reported for every field";
+}
+
+TEST(UnitTest, ReorderedLargeKeyConversion)
+{
+    // Keys above 2^53 differ by less than the precision of a double
+    const Long64_t offset = 1LL << 60;
+    {
+        auto rootFile = std::make_shared<TFile>("/tmp/TestReorderLargeKey.root", "RECREATE");
+        auto tree = std::make_shared<TTree>("Events", "Tree with 64-bit timestamps in reverse order");
+        Long64_t timestamp;
+        tree->Branch("timestamp", &timestamp, "timestamp/L");
+        for (int i = 0; i < 1000; i++)
+        {
+            timestamp = offset + 999 - i;
+            tree->Fill();
+        }
+        rootFile->Write();
+        rootFile->Close();
+    }
+
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestReorderLargeKey.root", "/tmp/TestReorderLargeKey.ntuple", "Events");
+    EXPECT_NO_THROW(conversion->SetReorder({"timestamp"}, 1000));
+    EXPECT_NO_THROW(conversion->Convert());
+
+    auto ntuple = RNTupleReader::Open("Events", "/tmp/TestReorderLargeKey.ntuple");
+    auto viewTimestamp = ntuple->GetView<std::int64_t>("timestamp");
+    for (auto entryId : *ntuple)
+    {
+        EXPECT_EQ(offset + (Long64_t)entryId, viewTimestamp(entryId)) << "Entries are not sorted by 'timestamp' at entry " << entryId;
+    }
+}
+
+TEST(UnitTest, StringDictionaryConversion)
+{
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestFile.root", "/tmp/TestStringDictionary.ntuple", "MixedTree");
+    EXPECT_NO_THROW(conversion->SetDictionary({"../../test/SimpleClass_cxx"}));
+    EXPECT_NO_THROW(conversion->SelectBranches({"RVec_string", "string_"}));
+    EXPECT_NO_THROW(conversion->SetStringDictionaryEncoding(kTRUE));
+    EXPECT_NO_THROW(conversion->Convert());
+
+    // 'RVec_string' holds five distinct values and is encoded; 'string_' is unique per entry and is not
+    auto dictionary = TTreeToRNTuple::ReadStringDictionary("/tmp/TestStringDictionary.ntuple", "MixedTree", "RVec_string");
+    EXPECT_EQ(5, dictionary.size()) << "[Dictionary size] Field 'RVec_string' has a wrong dictionary";
+    EXPECT_THROW(TTreeToRNTuple::ReadStringDictionary("/tmp/TestStringDictionary.ntuple", "MixedTree", "string_"), RException);
+
+    auto ntuple = RNTupleReader::Open("MixedTree", "/tmp/TestStringDictionary.ntuple");
+    auto viewRVecString = ntuple->GetView<std::vector<std::uint32_t>>("RVec_string");
+    auto viewString = ntuple->GetView<std::string>("string_");
+    for (auto entryId : *ntuple)
+    {
+        auto indices = viewRVecString(entryId);
+        EXPECT_EQ(5, indices.size()) << "[RVec length] Branch 'RVec_string' and field 'RVec_string' differ at entry " << entryId;
+        for (decltype(indices.size()) i = 0; i < indices.size(); i++)
+        {
+            EXPECT_STREQ(std::to_string(i).c_str(), dictionary.at(indices[i]).c_str()) << "Branch 'RVec_string' and field 'RVec_string' differ at entry " << entryId << " at index" << i;
+        }
+        EXPECT_STREQ(std::to_string(entryId).c_str(), viewString(entryId).c_str()) << "Branch 'string_' and field 'string_' differ at entry " << entryId;
+    }
+}
+
+TEST(UnitTest, StreamingConversion)
+{
+    gROOT->cd();
+    auto tree = std::make_shared<TTree>("Live", "Tree filled by a running producer");
+    Int_t nHits;
+    Float_t hits[10];
+    std::vector<int> channels;
+    tree->Branch("nHits", &nHits, "nHits/I");
+    tree->Branch("hits", hits, "hits[nHits]/F");
+    tree->Branch("channels", &channels);
+
+    Long64_t maxEntries = 100;
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("", "/tmp/TestStreaming.ntuple", "");
+    EXPECT_NO_THROW(conversion->SetMaxEntriesPerFile(maxEntries));
+    EXPECT_NO_THROW(conversion->SetCommitInterval(60));
+    EXPECT_NO_THROW(conversion->Attach(tree.get()));
+    for (int i = 0; i < nEntries; i++)
+    {
+        nHits = i % 10;
+        channels.assign(nHits, i);
+        for (int j = 0; j < nHits; j++)
+        {
+            hits[j] = i + j;
+        }
+        tree->Fill();
+        EXPECT_NO_THROW(conversion->Fill());
+    }
+    EXPECT_NO_THROW(conversion->Commit());
+    EXPECT_FALSE(gSystem->AccessPathName(conversion->GetManifestFile().c_str())) << "The manifest is not written when a piece is committed";
+    EXPECT_TRUE(gSystem->AccessPathName((conversion->GetManifestFile() + ".tmp").c_str())) << "The temporary manifest is left behind";
+    EXPECT_NO_THROW(conversion->Detach());
+
+    auto pieces = conversion->GetOutputPieces();
+    EXPECT_EQ((nEntries + maxEntries - 1) / maxEntries, pieces.size()) << "[Number of pieces] Streamed output is not split by entries";
+    for (auto &piece : pieces)
+    {
+        auto ntuple = RNTupleReader::Open(piece.ntupleName, piece.fileName);
+        EXPECT_EQ(piece.nEntries, ntuple->GetNEntries()) << "[Number of entries] Piece '" << piece.fileName << "' is not complete";
+        auto viewHits = ntuple->GetView<std::vector<float>>("hits");
+        auto viewChannels = ntuple->GetView<std::vector<int>>("channels");
+        for (auto entryId : *ntuple)
+        {
+            Long64_t i = piece.firstEntry + entryId;
+            auto v = viewHits(entryId);
+            EXPECT_EQ(static_cast<size_t>(i % 10), v.size()) << "Branch 'hits' and field 'hits' differ at entry " << i;
+            for (decltype(v.size()) j = 0; j < v.size(); j++)
+            {
+                EXPECT_FLOAT_EQ(i + j, v[j]) << "Branch 'hits' and field 'hits' differ at entry " << i << " at index " << j;
+            }
+            EXPECT_EQ(std::vector<int>(i % 10, i), viewChannels(entryId)) << "Branch 'channels' and field 'channels' differ at entry " << i;
+        }
+    }
+
+    conversion->SetFilter("nHits > 1");
+    EXPECT_THROW(conversion->Attach(tree.get()), RException);
+}
+
+TEST(UnitTest, StreamingDeletedTree)
+{
+    // The producer deletes its tree before the converter, which closes the output in its destructor
+    gROOT->cd();
+    {
+        auto tree = std::make_unique<TTree>("Live", "Tree deleted before the converter");
+        Int_t value;
+        tree->Branch("value", &value, "value/I");
+        auto conversion = std::make_unique<TTreeToRNTuple>("", "/tmp/TestStreamingDeleted.ntuple", "");
+        EXPECT_NO_THROW(conversion->Attach(tree.get()));
+        for (value = 0; value < 100; value++)
+        {
+            tree->Fill();
+            EXPECT_NO_THROW(conversion->Fill());
+        }
+        tree.reset();
+        conversion.reset();
+    }
+    auto ntuple = RNTupleReader::Open("Live", "/tmp/TestStreamingDeleted.ntuple");
+    EXPECT_EQ(100, ntuple->GetNEntries()) << "[Number of entries] Streamed entries are lost when the tree is deleted first";
+
+    // The commit interval does not split the output of Convert()
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestReorder.root", "/tmp/TestCommitInterval.ntuple", "Events");
+    EXPECT_NO_THROW(conversion->SetCommitInterval(1e-9));
+    EXPECT_NO_THROW(conversion->Convert());
+    ASSERT_EQ(1, conversion->GetOutputPieces().size()) << "[Number of pieces] Convert() rolls over by time";
+    EXPECT_EQ("/tmp/TestCommitInterval.ntuple", conversion->GetOutputPieces().front().fileName);
+}
+
+TEST(UnitTest, GeneratedConverterSource)
+{
+    std::unique_ptr<TTreeToRNTuple> conversion = std::make_unique<TTreeToRNTuple>("/tmp/TestFile.root", "/tmp/TestGenericConverter.ntuple", "MixedTree");
+    EXPECT_NO_THROW(conversion->SetDictionary({"../../test/SimpleClass_cxx"}));
+    EXPECT_NO_THROW(conversion->SelectBranches({"x", "nZ", "z", "vec_bool", "RVec_string", "tuple_", "simpleClass"}));
+    EXPECT_NO_THROW(conversion->Convert());
+    EXPECT_NO_THROW(conversion->GenerateConverterSource("/tmp/TestConverter.cxx"));
+
+    std::ifstream sourceFile("/tmp/TestConverter.cxx");
+    std::string source((std::istreambuf_iterator<char>(sourceFile)), std::istreambuf_iterator<char>());
+    EXPECT_NE(std::string::npos, source.find("struct MixedTreeEntry")) << "No struct is generated for tree 'MixedTree'";
+    EXPECT_NE(std::string::npos, source.find("#include \"SimpleClass.h\"")) << "The declaration of 'SimpleClass' is not included";
+    EXPECT_NE(std::string::npos, source.find("CopyArray(fzBuffer, fzCapacity, *fnZ, *fz)")) << "Variable-size array 'z' is not copied with its length 'nZ'";
+
+    // Compile the generated converter with the interpreter and compare its output with the generic conversion
+    gInterpreter->AddIncludePath("../../test");
+    ASSERT_TRUE(gInterpreter->Declare(("#define TTREETORNTUPLE_CONVERTER_NO_MAIN\n" + source).c_str())) << "The generated converter does not compile";
+    EXPECT_EQ(nEntries, gInterpreter->Calc("ConvertFile(\"/tmp/TestFile.root\", \"/tmp/TestConverter.ntuple\")")) << "The generated converter fails";
+
+    auto generic = RNTupleReader::Open("MixedTree", "/tmp/TestGenericConverter.ntuple");
+    auto specialized = RNTupleReader::Open("MixedTree", "/tmp/TestConverter.ntuple");
+    ASSERT_EQ(generic->GetNEntries(), specialized->GetNEntries()) << "[Number of entries] Generic and generated converters write different number of entries";
+    for (auto entryId : *generic)
+    {
+        std::ostringstream genericEntry, specializedEntry;
+        generic->Show(entryId, ENTupleShowFormat::kCompleteJSON, genericEntry);
+        specialized->Show(entryId, ENTupleShowFormat::kCompleteJSON, specializedEntry);
+        EXPECT_EQ(genericEntry.str(), specializedEntry.str()) << "Generic and generated converters differ at entry " << entryId;
+    }
+
+    // Settings the generated converter would silently ignore are refused
+    conversion->SetMaxEntriesPerFile(10);
+    EXPECT_THROW(conversion->GenerateConverterSource("/tmp/TestConverter.cxx"), RException);
+    conversion->SetMaxEntriesPerFile(0);
+    conversion->SetStringDictionaryEncoding(kTRUE);
+    EXPECT_THROW(conversion->GenerateConverterSource("/tmp/TestConverter.cxx"), RException);
+    conversion->SetStringDictionaryEncoding(kFALSE);
+    conversion->SetFilter("nZ > 1");
+    EXPECT_THROW(conversion->GenerateConverterSource("/tmp/TestConverter.cxx"), RException);
+}